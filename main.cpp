@@ -3,7 +3,9 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <numeric>
 #include <unordered_map>
+#include <unordered_set>
 #include <fstream>
 #include <winsock2.h>
 #include <windows.h>
@@ -12,9 +14,30 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <queue>
 #include <future>
 #include <functional>
+#include <iterator>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <chrono>
+#include <io.h>
+#include <fcntl.h>
+
+// Flag shared between whoever wants work to end early and the tasks doing it, which look at it between chunks of
+// their work. Copies share the same flag
+class StopToken {
+private:
+    std::shared_ptr<std::atomic<bool>> stopped = std::make_shared<std::atomic<bool>>(false);
+
+public:
+    void requestStop() const { stopped->store(true); }
+    bool stopRequested() const { return stopped->load(std::memory_order_relaxed); }
+};
 
 class ThreadPool {
 private:
@@ -73,25 +96,616 @@ public:
         condition.notify_one();
         return res;
     }
+
+    size_t threadCount() const { return workers.size(); }
+
+    // Drops the tasks still waiting in the queue, running ones finish on their own. The futures of dropped tasks
+    // throw std::future_error (broken promise) from get(). Returns how many tasks were dropped
+    size_t cancelPending() {
+        std::queue<std::function<void()>> dropped;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            dropped.swap(tasks);
+        }
+        return dropped.size(); // The tasks and their promises are destroyed here, outside the lock
+    }
 };
 
-std::string readPngMetadata(const std::string& fileName);
+// Non-owning view of bytes kept alive elsewhere, most of the time inside an Arena
+struct StrRef {
+    const char* data = nullptr;
+    size_t size = 0;
 
-std::mutex mtx;
-std::condition_variable cv;
-bool allProcessed = false;
+    StrRef() {}
+    StrRef(const char* data, size_t size) : data(data), size(size) {}
+    StrRef(const std::string& s) : data(s.data()), size(s.size()) {}
 
-void processFile(const std::string& folderPath, const std::string& fileName, std::unordered_map<std::string, std::string>& myDictionary) {
-    std::string fullPath = folderPath + "\\" + fileName;
-    std::string title = fileName.substr(0, fileName.length() - 4);
-    std::string metadata = readPngMetadata(fullPath);
-    
-    {
-        std::lock_guard<std::mutex> lock(mtx);
-        myDictionary[title] = metadata;
+    std::string str() const { return std::string(data, size); }
+    bool empty() const { return size == 0; }
+};
+
+// Bump allocator for the strings collected during a scan. Allocating is a pointer increment inside
+// large blocks, nothing is freed one by one and everything goes away at once with the arena
+class Arena {
+private:
+    std::vector<std::unique_ptr<char[]>> blocks; // Every block handed out so far, released together
+    char* cursor = nullptr;                      // Next free byte of the current block
+    size_t remaining = 0;                        // Free bytes left in the current block
+    size_t nextBlockSize = 64 * 1024;            // Blocks start small and double, so small scans don't waste memory
+    size_t bytesUsed = 0;
+
+    static const size_t MAX_BLOCK_SIZE = 4 * 1024 * 1024;
+
+public:
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    char* allocate(size_t size) {
+        if (size > remaining) {
+            size_t blockSize = std::max(size, nextBlockSize);
+            blocks.emplace_back(new char[blockSize]);
+            cursor = blocks.back().get();
+            remaining = blockSize;
+            nextBlockSize = std::min(nextBlockSize * 2, MAX_BLOCK_SIZE);
+        }
+        char* result = cursor;
+        cursor += size;
+        remaining -= size;
+        bytesUsed += size;
+        return result;
+    }
+
+    StrRef copy(const char* data, size_t size) {
+        char* target = allocate(size);
+        memcpy(target, data, size);
+        return StrRef(target, size);
+    }
+
+    size_t used() const { return bytesUsed; }
+};
+
+// 64-bit hash of a byte string, eight bytes per step
+inline uint64_t hashBytes(const char* data, size_t size) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ull;
+    return hash ^ (hash >> 29);
+}
+
+// Set of distinct byte strings, each stored once back to back and known by a dense id.
+// Lookups go through an open addressing table of ids, so interning a string that is already there allocates nothing
+class StringPool {
+private:
+    std::string bytes;                // Distinct strings back to back
+    std::vector<uint64_t> offsets{0}; // String i is [offsets[i], offsets[i + 1])
+    std::vector<uint64_t> hashes;     // Hash of each string, kept so growing the table and merging pools never rehash bytes
+    std::vector<uint32_t> table;      // Power of two slots holding ids, EMPTY_SLOT when free
+
+    static const uint32_t EMPTY_SLOT = UINT32_MAX;
+
+    void grow() {
+        std::vector<uint32_t> larger(table.empty() ? 64 : table.size() * 2, EMPTY_SLOT);
+        size_t mask = larger.size() - 1;
+        for (uint32_t id = 0; id < hashes.size(); ++id) {
+            size_t slot = hashes[id] & mask;
+            while (larger[slot] != EMPTY_SLOT) slot = (slot + 1) & mask;
+            larger[slot] = id;
+        }
+        table.swap(larger);
+    }
+
+public:
+    size_t size() const { return hashes.size(); }
+    size_t byteSize() const { return bytes.size(); }
+    StrRef get(uint32_t id) const { return StrRef(bytes.data() + offsets[id], offsets[id + 1] - offsets[id]); }
+    uint64_t hash(uint32_t id) const { return hashes[id]; }
+
+    uint32_t intern(StrRef s, uint64_t hash) {
+        if ((hashes.size() + 1) * 2 > table.size()) grow();
+        size_t mask = table.size() - 1;
+        size_t slot = hash & mask;
+        for (; table[slot] != EMPTY_SLOT; slot = (slot + 1) & mask) {
+            uint32_t id = table[slot];
+            if (hashes[id] == hash && offsets[id + 1] - offsets[id] == s.size && memcmp(bytes.data() + offsets[id], s.data, s.size) == 0)
+                return id;
+        }
+
+        uint32_t id = (uint32_t)hashes.size();
+        bytes.append(s.data, s.size);
+        offsets.push_back(bytes.size());
+        hashes.push_back(hash);
+        table[slot] = id;
+        return id;
+    }
+
+    uint32_t intern(StrRef s) { return intern(s, hashBytes(s.data, s.size)); }
+
+    // Forgets every string but keeps the buffers and the table size
+    void clear() {
+        bytes.clear();
+        offsets.assign(1, 0);
+        hashes.clear();
+        std::fill(table.begin(), table.end(), EMPTY_SLOT);
+    }
+};
+
+// Collects the lowercase trigrams of an image's metadata and turns them into a blocked Bloom signature:
+// every trigram sets two bits inside one 64-bit word, and the signature gets two bits per distinct trigram,
+// which keeps a false positive per probed trigram under one in two and per multi-word term far rarer.
+// Text is fed as "keyword: value" per entry and trigrams never span a line break, like search terms
+class TrigramSignatureBuilder {
+private:
+    std::vector<uint32_t> trigrams; // Trigrams of the current image, three lowercase bytes each
+    uint32_t window = 0;          // Last lowercase bytes fed, newest in the low byte
+    int windowLength = 0;
+
+public:
+    // Spreads a 24-bit trigram over 64 bits, the same mixing is used for queries
+    static uint64_t hashTrigram(uint32_t trigram) { return (trigram + 1) * 0x9E3779B97F4A7C15ull; }
+
+    // Word of a signature of 'wordCount' words a trigram hash lands in, and the two bits it sets there
+    static size_t wordOf(uint64_t hash, size_t wordCount) { return (size_t)(((hash >> 32) * wordCount) >> 32); }
+    static uint64_t maskOf(uint64_t hash) { return (1ull << (hash & 63)) | (1ull << ((hash >> 6) & 63)); }
+
+    // True unless the signature proves one of the trigrams is missing
+    static bool mayContain(const uint64_t* words, size_t wordCount, const std::vector<uint64_t>& trigramHashes) {
+        for (uint64_t hash : trigramHashes) {
+            uint64_t mask = maskOf(hash);
+            if ((words[wordOf(hash, wordCount)] & mask) != mask) return false;
+        }
+        return true;
+    }
+
+    void reset() {
+        trigrams.clear();
+        breakText();
+    }
+
+    // Ends the current run of text, the next bytes start fresh trigrams
+    void breakText() {
+        window = 0;
+        windowLength = 0;
+    }
+
+    void feed(const char* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            if (data[i] == '\n') {
+                breakText();
+                continue;
+            }
+            window = ((window << 8) | (unsigned char)::tolower((unsigned char)data[i])) & 0xFFFFFF;
+            if (++windowLength >= 3) trigrams.push_back(window);
+        }
+    }
+
+    // Distinct trigrams fed since the last reset, in increasing order
+    const std::vector<uint32_t>& distinctTrigrams() {
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+        return trigrams;
+    }
+
+    // Appends the signature of everything fed since the last reset to 'words'
+    void finish(std::vector<uint64_t>& words) {
+        const std::vector<uint32_t>& distinct = distinctTrigrams();
+        size_t wordCount = std::max<size_t>(1, (2 * distinct.size() + 63) / 64);
+        size_t base = words.size();
+        words.resize(base + wordCount, 0);
+        for (uint32_t trigram : distinct) {
+            uint64_t hash = hashTrigram(trigram);
+            words[base + wordOf(hash, wordCount)] |= maskOf(hash);
+        }
+    }
+};
+
+// Distinct trigrams of a lowercase search term in increasing order. Terms under three bytes give none
+std::vector<uint32_t> termTrigrams(const std::string& lowerTerm) {
+    std::vector<uint32_t> trigrams;
+    for (size_t i = 0; i + 3 <= lowerTerm.size(); ++i)
+        trigrams.push_back(((unsigned char)lowerTerm[i] << 16) | ((unsigned char)lowerTerm[i + 1] << 8) | (unsigned char)lowerTerm[i + 2]);
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    return trigrams;
+}
+
+// Trigram hashes of a lowercase search term, what a signature is probed with
+std::vector<uint64_t> termTrigramHashes(const std::string& lowerTerm) {
+    std::vector<uint64_t> hashes;
+    for (uint32_t trigram : termTrigrams(lowerTerm)) hashes.push_back(TrigramSignatureBuilder::hashTrigram(trigram));
+    return hashes;
+}
+
+// Bytes that make up index tokens: letters, digits, underscores and anything outside ASCII
+inline bool isTokenByte(unsigned char c) {
+    return ::isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// Splits text into lowercase tokens, calling onToken(StrRef token, size_t start) for each with its byte offset.
+// 'scratch' holds the lowercased token and is reused between calls
+template<class OnToken>
+void forEachToken(const char* data, size_t size, std::string& scratch, OnToken onToken) {
+    size_t i = 0;
+    while (i < size) {
+        while (i < size && !isTokenByte((unsigned char)data[i])) ++i;
+        size_t start = i;
+        scratch.clear();
+        while (i < size && isTokenByte((unsigned char)data[i])) scratch += (char)::tolower((unsigned char)data[i++]);
+        if (!scratch.empty()) onToken(StrRef(scratch.data(), scratch.size()), start);
+    }
+}
+
+// Raw deflate streams with a preset dictionary of the strings image generators write over and over,
+// so that the few hundred bytes of a single image still compress well on their own
+class MetadataCodec {
+private:
+    z_stream deflater;
+    z_stream inflater;
+    bool deflaterReady = false;
+    bool inflaterReady = false;
+
+    static StrRef dictionary() {
+        static const char text[] =
+            "masterpiece, best quality, highly detailed, ultra detailed, 8k, photorealistic, 1girl, solo, looking at viewer, "
+            "lowres, bad anatomy, bad hands, text, error, missing fingers, extra digit, fewer digits, cropped, worst quality, "
+            "low quality, normal quality, jpeg artifacts, signature, watermark, username, blurry, deformed, ugly, "
+            "{\"class_type\": \"CLIPTextEncode\", \"inputs\": {\"text\": \"KSampler\", \"seed\": \"steps\": \"cfg\": "
+            "\"sampler_name\": \"scheduler\": \"denoise\": \"model\": [\"CheckpointLoaderSimple\", \"ckpt_name\": "
+            "<lora:, Version: v1.6.0, Hires upscale: 2, Hires steps: 10, Hires upscaler: Latent, Denoising strength: 0.5, "
+            "Clip skip: 2, ENSD: 31337, Size: 512x512, Size: 512x768, Size: 1024x1024, Model hash: , Model: , Seed: , "
+            "Sampler: Euler a, Sampler: DPM++ 2M Karras, CFG scale: 7, Steps: 20, Steps: 30, \nNegative prompt: ";
+        return StrRef(text, sizeof(text) - 1);
+    }
+
+public:
+    MetadataCodec() {}
+    MetadataCodec(const MetadataCodec&) = delete;
+    MetadataCodec& operator=(const MetadataCodec&) = delete;
+
+    ~MetadataCodec() {
+        if (deflaterReady) deflateEnd(&deflater);
+        if (inflaterReady) inflateEnd(&inflater);
+    }
+
+    // Appends the compressed form of 'raw' to 'out'
+    void compress(StrRef raw, std::string& out) {
+        if (!deflaterReady) {
+            memset(&deflater, 0, sizeof(deflater));
+            deflateInit2(&deflater, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            deflaterReady = true;
+        } else {
+            deflateReset(&deflater);
+        }
+        StrRef dict = dictionary();
+        deflateSetDictionary(&deflater, (const Bytef*)dict.data, (uInt)dict.size);
+
+        size_t base = out.size();
+        out.resize(base + deflateBound(&deflater, (uLong)raw.size));
+        deflater.next_in = (Bytef*)raw.data;
+        deflater.avail_in = (uInt)raw.size;
+        deflater.next_out = (Bytef*)&out[base];
+        deflater.avail_out = (uInt)(out.size() - base);
+        deflate(&deflater, Z_FINISH);
+        out.resize(out.size() - deflater.avail_out);
+    }
+
+    // Replaces 'out' with the 'rawSize' bytes packed in 'block'
+    bool decompress(StrRef block, size_t rawSize, std::string& out) {
+        if (!inflaterReady) {
+            memset(&inflater, 0, sizeof(inflater));
+            inflateInit2(&inflater, -15);
+            inflaterReady = true;
+        } else {
+            inflateReset(&inflater);
+        }
+        StrRef dict = dictionary();
+        inflateSetDictionary(&inflater, (const Bytef*)dict.data, (uInt)dict.size);
+
+        out.resize(rawSize);
+        inflater.next_in = (Bytef*)block.data;
+        inflater.avail_in = (uInt)block.size;
+        inflater.next_out = (Bytef*)&out[0];
+        inflater.avail_out = (uInt)rawSize;
+        return inflate(&inflater, Z_FINISH) == Z_STREAM_END;
+    }
+};
+
+// Variable length integers used by the packed metadata blocks
+inline void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
     }
+    out += (char)value;
 }
 
+inline uint64_t readVarint(const char*& cursor, const char* end) {
+    uint64_t value = 0;
+    for (int shift = 0; cursor != end && shift < 64; shift += 7) {
+        unsigned char byte = (unsigned char)*cursor++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    return value;
+}
+
+// Reads a varint length, clamped to the bytes left after it so a damaged length never reaches past 'end'
+inline size_t readLength(const char*& cursor, const char* end) {
+    uint64_t length = readVarint(cursor, end);
+    return (size_t)std::min<uint64_t>(length, end - cursor);
+}
+
+// Columnar store of everything known about the scanned images. An image is identified by its dense index and
+// its title is an offset into one contiguous buffer. tEXt keywords are interned into a symbol table, and values
+// are split into lines that are stored once however many images share them: the same negative prompt, settings
+// line or workflow repeated across a corpus costs one copy plus a 4 byte reference per image.
+// Every image also has a trigram signature that searches probe first, so most non-matches are rejected with a few
+// word-sized ANDs. A compressed store keeps only titles, signatures and one deflated block per image, and only
+// decompresses the images whose signature may match
+struct ImageStore {
+    std::string titleBytes;                     // All titles back to back
+    std::vector<uint64_t> titleOffsets{0};      // Title of image i is [titleOffsets[i], titleOffsets[i + 1])
+    std::vector<uint32_t> entryOffsets{0};      // tEXt entries of image i are [entryOffsets[i], entryOffsets[i + 1])
+    std::vector<uint32_t> entryKeywords;        // Per entry, symbol id of its keyword
+    std::vector<uint32_t> entryLineOffsets{0};  // Value lines of entry e are lineRefs[entryLineOffsets[e] .. entryLineOffsets[e + 1])
+    std::vector<uint32_t> lineRefs;             // Per value line, id of the distinct line in 'lines'
+    StringPool keywords;                        // Keyword symbol table
+    StringPool lines;                           // Distinct value lines
+
+    bool compressed = false;                    // Entries live in 'blocks' instead of the columns above
+    std::string blocks;                         // Per image, its entries packed as varint-prefixed keyword/value pairs, then deflated
+    std::vector<uint64_t> blockOffsets{0};      // Block of image i is [blockOffsets[i], blockOffsets[i + 1])
+    std::vector<uint32_t> rawSizes;             // Packed size of each block before deflating
+
+    std::vector<uint64_t> signatureWords;       // Trigram signatures back to back
+    std::vector<uint64_t> signatureOffsets{0};  // Signature of image i is [signatureOffsets[i], signatureOffsets[i + 1])
+
+    size_t size() const { return entryOffsets.size() - 1; }
+
+    StrRef title(size_t id) const { return StrRef(titleBytes.data() + titleOffsets[id], titleOffsets[id + 1] - titleOffsets[id]); }
+    uint32_t entryBegin(size_t id) const { return entryOffsets[id]; }
+    uint32_t entryEnd(size_t id) const { return entryOffsets[id + 1]; }
+    StrRef keyword(size_t entry) const { return keywords.get(entryKeywords[entry]); }
+    uint32_t lineBegin(size_t entry) const { return entryLineOffsets[entry]; }
+    uint32_t lineEnd(size_t entry) const { return entryLineOffsets[entry + 1]; }
+    StrRef line(size_t lineIndex) const { return lines.get(lineRefs[lineIndex]); }
+
+    // Rebuilds the full text of an entry, only needed when a value leaves the program
+    std::string value(size_t entry) const {
+        std::string text;
+        for (uint32_t l = lineBegin(entry); l < lineEnd(entry); ++l) {
+            if (l != lineBegin(entry)) text += '\n';
+            StrRef part = line(l);
+            text.append(part.data, part.size);
+        }
+        return text;
+    }
+
+    void reserve(size_t images) {
+        titleOffsets.reserve(images + 1);
+        entryOffsets.reserve(images + 1);
+    }
+
+    // Empties the store but keeps its memory, for scratch stores reused image after image
+    void clear() {
+        titleBytes.clear();
+        titleOffsets.assign(1, 0);
+        entryOffsets.assign(1, 0);
+        entryKeywords.clear();
+        entryLineOffsets.assign(1, 0);
+        lineRefs.clear();
+        keywords.clear();
+        lines.clear();
+        blocks.clear();
+        blockOffsets.assign(1, 0);
+        rawSizes.clear();
+        signatureWords.clear();
+        signatureOffsets.assign(1, 0);
+    }
+
+    // Adds an image of a compressed store from its packed entries, see packEntry
+    void addCompressedImage(StrRef title, StrRef packed, MetadataCodec& codec) {
+        titleBytes.append(title.data, title.size);
+        titleOffsets.push_back(titleBytes.size());
+        entryOffsets.push_back(entryOffsets.back());
+        codec.compress(packed, blocks);
+        blockOffsets.push_back(blocks.size());
+        rawSizes.push_back((uint32_t)packed.size);
+    }
+
+    // Signs the last added image with the trigrams fed to 'signature'
+    void addSignature(TrigramSignatureBuilder& signature) {
+        signature.finish(signatureWords);
+        signatureOffsets.push_back(signatureWords.size());
+    }
+
+    static void packEntry(std::string& packed, StrRef keyword, StrRef value) {
+        appendVarint(packed, keyword.size);
+        packed.append(keyword.data, keyword.size);
+        appendVarint(packed, value.size);
+        packed.append(value.data, value.size);
+    }
+
+    // Signs the last added image with a signature built elsewhere
+    void addSignatureWords(const uint64_t* words, size_t wordCount) {
+        signatureWords.insert(signatureWords.end(), words, words + wordCount);
+        signatureOffsets.push_back(signatureWords.size());
+    }
+
+    // True unless the signature proves one of the trigrams is missing from the image, always true without a signature
+    bool mayContain(size_t id, const std::vector<uint64_t>& trigramHashes) const {
+        if (signatureOffsets.size() <= id + 1) return true;
+        return TrigramSignatureBuilder::mayContain(signatureWords.data() + signatureOffsets[id],
+                                                   signatureOffsets[id + 1] - signatureOffsets[id], trigramHashes);
+    }
+
+    // Starts a new image, the entries added next belong to it
+    void addImage(StrRef title) {
+        titleBytes.append(title.data, title.size);
+        titleOffsets.push_back(titleBytes.size());
+        entryOffsets.push_back(entryOffsets.back());
+    }
+
+    // Takes back the entries of the last image, which keeps its title
+    void dropLastEntries() {
+        uint32_t first = entryOffsets[entryOffsets.size() - 2];
+        entryKeywords.resize(first);
+        lineRefs.resize(entryLineOffsets[first]);
+        entryLineOffsets.resize(first + 1);
+        entryOffsets.back() = first;
+    }
+
+    void addEntry(StrRef keyword, StrRef value) {
+        entryKeywords.push_back(keywords.intern(keyword));
+        const char* end = value.data + value.size;
+        for (const char* start = value.data; ; ) {
+            const char* newline = (const char*)memchr(start, '\n', end - start);
+            const char* stop = newline ? newline : end;
+            lineRefs.push_back(lines.intern(StrRef(start, stop - start)));
+            if (!newline) break;
+            start = newline + 1;
+        }
+        entryLineOffsets.push_back((uint32_t)lineRefs.size());
+        ++entryOffsets.back();
+    }
+
+    // Appends every image of another store, its symbols and lines are interned into this store's pools
+    void append(const ImageStore& other) {
+        if (compressed) {
+            const uint64_t blockBase = blocks.size();
+            blocks += other.blocks;
+            for (size_t i = 1; i < other.blockOffsets.size(); ++i) blockOffsets.push_back(blockBase + other.blockOffsets[i]);
+            rawSizes.insert(rawSizes.end(), other.rawSizes.begin(), other.rawSizes.end());
+        }
+        const uint64_t signatureBase = signatureWords.size();
+        signatureWords.insert(signatureWords.end(), other.signatureWords.begin(), other.signatureWords.end());
+        for (size_t i = 1; i < other.signatureOffsets.size(); ++i) signatureOffsets.push_back(signatureBase + other.signatureOffsets[i]);
+
+        std::vector<uint32_t> keywordMap(other.keywords.size()), lineMap(other.lines.size());
+        for (uint32_t id = 0; id < other.keywords.size(); ++id) keywordMap[id] = keywords.intern(other.keywords.get(id), other.keywords.hash(id));
+        for (uint32_t id = 0; id < other.lines.size(); ++id) lineMap[id] = lines.intern(other.lines.get(id), other.lines.hash(id));
+
+        const uint64_t titleBase = titleBytes.size();
+        const uint32_t entryBase = entryOffsets.back(), lineBase = (uint32_t)lineRefs.size();
+        titleBytes += other.titleBytes;
+        for (size_t i = 1; i < other.titleOffsets.size(); ++i) titleOffsets.push_back(titleBase + other.titleOffsets[i]);
+        for (size_t i = 1; i < other.entryOffsets.size(); ++i) entryOffsets.push_back(entryBase + other.entryOffsets[i]);
+        for (size_t i = 1; i < other.entryLineOffsets.size(); ++i) entryLineOffsets.push_back(lineBase + other.entryLineOffsets[i]);
+        for (uint32_t id : other.entryKeywords) entryKeywords.push_back(keywordMap[id]);
+        for (uint32_t id : other.lineRefs) lineRefs.push_back(lineMap[id]);
+    }
+};
+
+// Gives access to the entries of one image at a time: the store itself when it holds them, otherwise a scratch
+// store the image's block is decompressed into. Each thread keeps a reader of its own
+class ImageReader {
+private:
+    ImageStore scratch;
+    MetadataCodec codec;
+    std::string packed;
+
+public:
+    // Returns the store holding the entries of image 'id', 'viewId' receives the image's index in it
+    const ImageStore& open(const ImageStore& store, size_t id, size_t& viewId) {
+        if (!store.compressed) {
+            viewId = id;
+            return store;
+        }
+
+        viewId = 0;
+        StrRef block(store.blocks.data() + store.blockOffsets[id], store.blockOffsets[id + 1] - store.blockOffsets[id]);
+        return decode(store.title(id), block, store.rawSizes[id]);
+    }
+
+    // Decompresses one packed block of entries into the scratch store, where the image is index 0
+    const ImageStore& decode(StrRef title, StrRef block, size_t rawSize) {
+        scratch.clear();
+        scratch.addImage(title);
+        if (!codec.decompress(block, rawSize, packed)) return scratch;
+
+        const char* cursor = packed.data();
+        const char* end = cursor + packed.size();
+        while (cursor != end) {
+            size_t keywordLength = readLength(cursor, end);
+            StrRef keyword(cursor, keywordLength);
+            cursor += keywordLength;
+            size_t valueLength = readLength(cursor, end);
+            scratch.addEntry(keyword, StrRef(cursor, valueLength));
+            cursor += valueLength;
+        }
+        return scratch;
+    }
+};
+
+// How the matches of a search are handed back to the user
+enum class OutputMode {
+    Move,     // Move the matches into 'Filtered_Search' (default)
+    List,     // Print matching paths, one per line
+    List0,    // Print matching paths separated by NUL bytes, for xargs -0 and friends
+    Ndjson,   // Print one JSON record per match, with its metadata
+    Symlink,  // Build a farm of symbolic links to the matches in 'Filtered_Search'
+    Hardlink, // Build a farm of hard links to the matches in 'Filtered_Search'
+    Count,    // Print how many images match, nothing else is produced
+    Exists    // Print whether any image matches, stopping at the first one
+};
+
+// Order the files of a folder are read in, which is also the order their matches come out in
+enum class FileOrder {
+    Directory, // As FindNextFileA returns them (default)
+    Newest,    // Most recently written first
+    Smallest,  // Smallest first
+    Name,      // By name, ignoring case
+    Physical   // Where the data starts on disk, so a rotational drive reads the folder in one sweep
+};
+
+// How the metadata of the files is read from disk
+enum class ReadMode {
+    Cached, // Through the system file cache (default)
+    Direct  // Unbuffered, so a large scan does not push what other programs keep out of the file cache
+};
+
+// Options given on the command line, anything missing is asked for interactively
+struct SearchOptions {
+    std::string folderPath;
+    std::string wordsToSearch;
+    bool hasWordsToSearch = false;
+    OutputMode outputMode = OutputMode::Move;
+    std::string outputFile; // Empty means standard output
+    std::string groupBy;    // Metadata field whose value names the subfolder of each match, empty for no grouping
+    std::string rulesFile;  // Saved queries evaluated together instead of a single search, empty for none
+    bool compress = false;  // Keep the metadata deflated in memory, for folders too large to hold it as text
+    std::string indexFile;  // Index file reused between runs while the folder is unchanged, empty for none
+    size_t topCount = 0;    // Only keep this many matches, the most relevant first. 0 keeps every match unranked
+    std::string completePrefix; // Prefix whose most frequent completions are printed instead of searching
+    bool hasCompletePrefix = false;
+    std::vector<std::string> facets; // Fields whose values are counted over the matches instead of outputting them
+    bool estimate = false;  // Estimate the number of matches from a growing random sample of the files
+    size_t limit = 0;       // Stop once this many matches were found, 0 for no limit
+    unsigned long deadlineMs = 0; // Time budget of the search from the start of the run, 0 for none
+    FileOrder fileOrder = FileOrder::Directory;
+    ReadMode readMode = ReadMode::Cached;
+
+    // List style modes print results instead of touching 'Filtered_Search'
+    bool isListMode() const {
+        return outputMode == OutputMode::List || outputMode == OutputMode::List0 || outputMode == OutputMode::Ndjson;
+    }
+
+    // Count style modes only evaluate the query, no match is kept
+    bool isCountMode() const {
+        return outputMode == OutputMode::Count || outputMode == OutputMode::Exists;
+    }
+};
+
+std::string sanitizeFolderName(StrRef value);
+
 // Directory authenticator
 bool DirectoryExists(const char* dirName) {
     DWORD f = GetFileAttributesA(dirName);
@@ -130,21 +744,18 @@ int countPngFiles(const char* dirName, int& pngCount) {
     return pngCount;
 }
 
-// Function to create an empty dictionary whilst reserving memory for it
-std::unordered_map<std::string, std::string> createEmptyDictionary(int& pngCount) {
-    std::unordered_map<std::string, std::string> dictionary;
-    dictionary.reserve(pngCount);
-    return dictionary;
+// Function to create an empty store whilst reserving memory for it
+void reserveDictionary(ImageStore& store, int& pngCount) {
+    store.reserve(pngCount);
 }
 
 // Function that split the words to search which is then used to filter images
 std::vector<std::string> splitWordsToSearch(const std::string& wordsToSearch) {
     std::vector<std::string> splitWords;
-    std::istringstream iss(wordsToSearch);
     std::string word;
+    char closing = 0; // '/' or '"' while inside a regular expression or a quoted term, where commas don't split
 
-    // Split the string by comma
-    while (std::getline(iss, word, ',')) {
+    auto addWord = [&splitWords](const std::string& word) {
         // Trim leading and trailing spaces from each word
         size_t start = word.find_first_not_of(" ");
         size_t end = word.find_last_not_of(" ");
@@ -154,195 +765,3751 @@ std::vector<std::string> splitWordsToSearch(const std::string& wordsToSearch) {
             // If the word is only spaces or empty, it is discarded
             splitWords.push_back("");
         }
+    };
+
+    // Split the string by comma
+    for (size_t i = 0; i < wordsToSearch.size(); ++i) {
+        char c = wordsToSearch[i];
+        if (closing) {
+            word += c;
+            if (c == '\\' && closing == '/' && i + 1 < wordsToSearch.size()) word += wordsToSearch[++i];
+            else if (c == closing) closing = 0;
+        } else if (c == ',') {
+            addWord(word);
+            word.clear();
+        } else {
+            if ((c == '/' || c == '"') && word.find_first_not_of(" ") == std::string::npos) closing = c;
+            word += c;
+        }
     }
+    if (!word.empty()) addWord(word);
 
     return splitWords;
 }
 
-// Helper function to read metadata from PNG chunks, focusing only on tEXt chunks with buffered reading, feel free to modify this if you need other metadata types
-std::string readPngMetadata(const std::string& fileName) {
-    std::ifstream file(fileName, std::ios::binary | std::ios::in);
-    if (!file) return ""; // Error opening file
-
-    std::string metadata;
-    const size_t BUFFER_SIZE = 65536; // 64KB buffer
-    char buffer[BUFFER_SIZE];
-
-    // Skip PNG signature
-    file.seekg(8, std::ios::beg);
-
-    while (file) {
-        uint32_t length, chunkType;
-        if (!file.read((char*)&length, 4)) break; // Read length
-        length = ntohl(length); // Convert from network to host byte order
-        if (!file.read((char*)&chunkType, 4)) break; // Read chunk type
-        chunkType = ntohl(chunkType);
-
-        if (chunkType == 0x74455874) { // Check if it's a tEXt chunk
-            std::string keyword, text;
-            // We only need to read 'length' bytes for tEXt data
-            if (length <= BUFFER_SIZE) {
-                if (file.read(buffer, length)) {
-                    size_t i = 0;
-                    while (i < length && buffer[i] != 0) keyword += buffer[i++];
-                    i++; // Skip null terminator
-                    text = std::string(buffer + i, length - i);
-                    metadata += keyword + ": " + text + "\n";
-                }
-            } else {
-                // If the chunk is larger than our buffer, we might need to handle this differently                
-                file.seekg(length, std::ios::cur);
+// Reads the metadata of PNG files one after another. Every file is opened and its first window requested with
+// overlapped I/O as soon as it is queued, so while one file is parsed the disk is already reading the next.
+// Reads are sector aligned into page aligned buffers, which lets ReadMode::Direct open the files unbuffered
+class PngMetadataReader {
+private:
+    static const size_t WINDOW_SIZE = 65536; // 64KB window, the first one usually holds all the text chunks
+    static const uint32_t MAX_TEXT_CHUNK_SIZE = 64u << 20; // Larger tEXt chunks are taken for corrupt lengths
+    static const size_t ALIGNMENT = 4096;    // Sector size that unbuffered reads are aligned to, a multiple of any disk's
+
+    struct QueuedFile {
+        HANDLE file = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped;    // First window, requested when the file was queued
+        bool pending = false;     // The first window is still being read
+        char* buffer = nullptr;   // Page aligned, owned by the slot and reused from file to file
+        size_t capacity = 0;
+    };
+
+    ReadMode mode;
+    QueuedFile slots[2];
+    int head = 0;   // Slot of the file parsed next
+    int queued = 0; // Files queued and not parsed yet
+
+    static void reserve(QueuedFile& slot, size_t size) {
+        if (slot.capacity >= size) return;
+        if (slot.buffer) VirtualFree(slot.buffer, 0, MEM_RELEASE);
+        slot.buffer = (char*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!slot.buffer) throw std::bad_alloc();
+        slot.capacity = size;
+    }
+
+    // Starts reading 'size' bytes at 'offset' into the slot's buffer, both aligned
+    static bool startRead(QueuedFile& slot, uint64_t offset, size_t size) {
+        memset(&slot.overlapped, 0, sizeof(slot.overlapped));
+        slot.overlapped.Offset = (DWORD)offset;
+        slot.overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        slot.pending = ReadFile(slot.file, slot.buffer, (DWORD)size, NULL, &slot.overlapped) || GetLastError() == ERROR_IO_PENDING;
+        return slot.pending;
+    }
+
+    // Waits for the read started on the slot, reading at or past the end of the file gives 0 bytes
+    static size_t finishRead(QueuedFile& slot) {
+        DWORD bytesRead = 0;
+        bool done = GetOverlappedResult(slot.file, &slot.overlapped, &bytesRead, TRUE) != 0;
+        slot.pending = false;
+        return done ? bytesRead : 0;
+    }
+
+    static void close(QueuedFile& slot) {
+        if (slot.file == INVALID_HANDLE_VALUE) return;
+        if (slot.pending) {
+            // The buffer must outlive the read, so it is cancelled and waited for
+            CancelIoEx(slot.file, &slot.overlapped);
+            finishRead(slot);
+        }
+        CloseHandle(slot.file);
+        slot.file = INVALID_HANDLE_VALUE;
+    }
+
+public:
+    explicit PngMetadataReader(ReadMode mode) : mode(mode) {}
+    PngMetadataReader(const PngMetadataReader&) = delete;
+    PngMetadataReader& operator=(const PngMetadataReader&) = delete;
+
+    ~PngMetadataReader() {
+        for (QueuedFile& slot : slots) {
+            close(slot);
+            if (slot.buffer) VirtualFree(slot.buffer, 0, MEM_RELEASE);
+        }
+    }
+
+    // Opens the file and starts reading its first window. At most two files are queued at once, a file that
+    // can't be opened is still queued and later parses as a failure
+    void queue(const std::string& fileName) {
+        QueuedFile& slot = slots[(head + queued) % 2];
+        ++queued;
+        // Only a window at the head of the file is wanted, so cached reads ask the cache manager not to read ahead past it
+        DWORD flags = FILE_FLAG_OVERLAPPED | (mode == ReadMode::Direct ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_RANDOM_ACCESS);
+        slot.file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, flags, NULL);
+        if (slot.file == INVALID_HANDLE_VALUE) return;
+        reserve(slot, WINDOW_SIZE);
+        startRead(slot, 0, WINDOW_SIZE);
+    }
+
+    // Helper function to read metadata from PNG chunks, focusing only on tEXt chunks with buffered reading, feel free to modify this if you need other metadata types.
+    // Parses the oldest queued file through its window buffer, every tEXt chunk is handed to onEntry(keyword, text) straight
+    // from that buffer, so once it has grown to its working size parsing a file does not allocate. Returns false if the file
+    // can't be opened or holds a chunk running past its end, whose length can't be trusted to size the buffer
+    template<class OnEntry>
+    bool parse(OnEntry onEntry) {
+        QueuedFile& slot = slots[head];
+        head ^= 1;
+        --queued;
+        if (slot.file == INVALID_HANDLE_VALUE) return false; // Error opening file
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(slot.file, &fileSize)) fileSize.QuadPart = 0;
+        bool intact = true;
+        uint64_t windowStart = 0; // File offset of buffer[0]
+        size_t windowLength = slot.pending ? finishRead(slot) : 0; // Valid bytes in the buffer
+
+        // Makes sure 'needed' bytes starting at 'offset' are in the buffer, reading a new aligned window when they are not
+        auto ensure = [&](uint64_t offset, size_t needed) -> bool {
+            if (offset >= windowStart && offset + needed <= windowStart + windowLength) return true;
+
+            uint64_t alignedStart = offset & ~(uint64_t)(ALIGNMENT - 1);
+            size_t size = (size_t)(offset - alignedStart + needed + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+            if (size < WINDOW_SIZE) size = WINDOW_SIZE;
+            reserve(slot, size);
+            windowStart = alignedStart;
+            windowLength = startRead(slot, alignedStart, size) ? finishRead(slot) : 0;
+            return offset + needed <= windowStart + windowLength;
+        };
+
+        // Skip PNG signature
+        uint64_t offset = 8;
+
+        while (ensure(offset, 8)) {
+            const char* header = slot.buffer + (offset - windowStart);
+            uint32_t length, chunkType;
+            memcpy(&length, header, 4);
+            memcpy(&chunkType, header + 4, 4);
+            length = ntohl(length); // Convert from network to host byte order
+            chunkType = ntohl(chunkType);
+            if (offset + 12 + (uint64_t)length > (uint64_t)fileSize.QuadPart || (chunkType == 0x74455874 && length > MAX_TEXT_CHUNK_SIZE)) {
+                intact = false;
+                break;
             }
-        } else {
-            // Skip this chunk since it's not tEXt
-            file.seekg(length + 4, std::ios::cur); // Skip chunk data + CRC
+
+            if (chunkType == 0x74455874) { // Check if it's a tEXt chunk
+                if (!ensure(offset + 8, length)) break;
+                const char* data = slot.buffer + (offset + 8 - windowStart);
+
+                // Keyword, null separator, then the text up to the end of the chunk
+                const char* separator = (const char*)memchr(data, 0, length);
+                size_t keywordLength = separator ? (size_t)(separator - data) : length;
+                size_t textStart = std::min<size_t>(keywordLength + 1, length);
+                onEntry(StrRef(data, keywordLength), StrRef(data + textStart, length - textStart));
+            }
+
+            offset += 12 + (uint64_t)length; // Length, type, chunk data and CRC
+        }
+
+        close(slot);
+        return intact;
+    }
+};
+
+// Function to read one batch of files on a pool worker into a store of its own. The path and the read buffers
+// are reused from file to file and the batch's columns grow geometrically, so the heap is rarely touched.
+// The next file is always queued before the current one is parsed, so its first read overlaps the parsing.
+// Every image is signed with its trigrams, a compressed batch packs its entries instead of filling the columns
+void processFileBatch(const std::string& folderPath, const std::vector<StrRef>& fileNames, size_t begin, size_t end, ImageStore& batch,
+                      ReadMode readMode) {
+    std::string fullPath = folderPath + "\\";
+    const size_t folderLength = fullPath.size();
+    PngMetadataReader reader(readMode);
+    batch.reserve(end - begin);
+
+    auto queueFile = [&](size_t i) {
+        fullPath.resize(folderLength);
+        fullPath.append(fileNames[i].data, fileNames[i].size);
+        reader.queue(fullPath);
+    };
+    if (begin < end) queueFile(begin);
+
+    MetadataCodec codec;
+    TrigramSignatureBuilder signature;
+    std::string packed;
+    for (size_t i = begin; i < end; ++i) {
+        const StrRef& fileName = fileNames[i];
+        if (i + 1 < end) queueFile(i + 1);
+        StrRef title(fileName.data, fileName.size - 4);
+
+        if (!batch.compressed) batch.addImage(title);
+        packed.clear();
+        signature.reset();
+        bool intact = reader.parse([&](StrRef keyword, StrRef text) {
+            if (batch.compressed) ImageStore::packEntry(packed, keyword, text);
+            else batch.addEntry(keyword, text);
+
+            // Signed as "keyword: value", the text searches look at
+            signature.breakText();
+            signature.feed(keyword.data, keyword.size);
+            signature.feed(": ", 2);
+            signature.feed(text.data, text.size);
+        });
+        if (!intact) {
+            // A damaged file is kept without metadata, like one that can't be opened
+            if (batch.compressed) packed.clear();
+            else batch.dropLastEntries();
+            signature.reset();
         }
+        if (batch.compressed) batch.addCompressedImage(title, packed, codec);
+        batch.addSignature(signature);
     }
+}
+
+// Function to find where a file lies on its volume: the first cluster of its data, and its file index, which
+// follows the order of the records in the master file table. Small files stored inside their record have no
+// clusters and get UINT64_MAX as the first, as do files on volumes that report no extents
+std::pair<uint64_t, uint64_t> physicalLocation(const std::string& path) {
+    std::pair<uint64_t, uint64_t> location(UINT64_MAX, UINT64_MAX);
+    HANDLE file = CreateFileA(path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE) return location;
 
-    return metadata;
+    // Only the first extent is needed, ERROR_MORE_DATA just says there are others
+    STARTING_VCN_INPUT_BUFFER input;
+    input.StartingVcn.QuadPart = 0;
+    RETRIEVAL_POINTERS_BUFFER extents;
+    DWORD returned = 0;
+    if ((DeviceIoControl(file, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input), &extents, sizeof(extents), &returned, NULL) ||
+         GetLastError() == ERROR_MORE_DATA) && extents.ExtentCount > 0 && extents.Extents[0].Lcn.QuadPart >= 0)
+        location.first = (uint64_t)extents.Extents[0].Lcn.QuadPart;
+
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle(file, &info))
+        location.second = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    CloseHandle(file);
+    return location;
 }
 
-// Fill dictionary with metadata, only processing PNG files
-std::unordered_map<std::string, std::string> fillDictionaryWithImageMetadata(const std::string& folderPath, std::unordered_map<std::string, std::string> myDictionary, ThreadPool& pool) {
+// A file of a listing with what it is sorted by, name last
+struct OrderedFile {
+    uint64_t key;
+    uint64_t secondKey;
+    StrRef name;
+};
+
+// Function to collect the names of the PNG files of a folder into the arena in the given order, false when there
+// are none. The listing already carries write times and sizes, only the physical order opens each file
+bool listPngFiles(const std::string& folderPath, Arena& nameArena, std::vector<StrRef>& fileNames, FileOrder order = FileOrder::Directory) {
     WIN32_FIND_DATAA findFileData;
     HANDLE hFind;
     std::string searchPath = folderPath + "\\*.png";
-    std::vector<std::future<void>> futures; // To keep track of futures
 
     hFind = FindFirstFileA(searchPath.c_str(), &findFileData);
     if (hFind == INVALID_HANDLE_VALUE) {
         std::cerr << "Could not find any PNG files in the directory." << std::endl;
-        return myDictionary;
+        return false;
     }
 
+    std::vector<OrderedFile> ordered; // Filled instead of fileNames when an order was asked for
     do {
-        std::string fileName = findFileData.cFileName;
-        if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-            futures.push_back(pool.enqueue([&, fileName]() {
-                processFile(folderPath, fileName, myDictionary);
-            }));
+        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        StrRef name = nameArena.copy(findFileData.cFileName, strlen(findFileData.cFileName));
+        if (order == FileOrder::Directory) {
+            fileNames.push_back(name);
+        } else if (order == FileOrder::Physical) {
+            std::pair<uint64_t, uint64_t> location = physicalLocation(folderPath + "\\" + findFileData.cFileName);
+            ordered.push_back({location.first, location.second, name});
+        } else {
+            const FILETIME& written = findFileData.ftLastWriteTime;
+            uint64_t key = order == FileOrder::Newest ? ~(((uint64_t)written.dwHighDateTime << 32) | written.dwLowDateTime)
+                                                      : ((uint64_t)findFileData.nFileSizeHigh << 32) | findFileData.nFileSizeLow;
+            ordered.push_back({order == FileOrder::Name ? 0 : key, 0, name});
         }
     } while (FindNextFileA(hFind, &findFileData) != 0);
 
     FindClose(hFind);
 
-    // Wait for all tasks to complete
-    for(auto& f : futures) f.wait();
-    return myDictionary;
-}
-
-// Function to filter the dictionary based on search terms
-void filterDictionary(std::unordered_map<std::string, std::string>& myDictionary, const std::vector<std::string>& wordsToSearch) {
-    // Convert all search terms to lowercase for case-insensitive comparison
-    std::vector<std::string> lowerCaseSearchWords;
-    for (const auto& word : wordsToSearch) {
-        std::string lowerWord = word;
-        std::transform(lowerWord.begin(), lowerWord.end(), lowerWord.begin(), ::tolower);
-        lowerCaseSearchWords.push_back(lowerWord);
+    if (!ordered.empty()) {
+        auto lessName = [](StrRef a, StrRef b) {
+            return std::lexicographical_compare(a.data, a.data + a.size, b.data, b.data + b.size,
+                [](char x, char y) { return ::tolower((unsigned char)x) < ::tolower((unsigned char)y); });
+        };
+        std::sort(ordered.begin(), ordered.end(), [&lessName](const OrderedFile& a, const OrderedFile& b) {
+            if (a.key != b.key) return a.key < b.key;
+            return a.secondKey != b.secondKey ? a.secondKey < b.secondKey : lessName(a.name, b.name);
+        });
+        for (const OrderedFile& file : ordered) fileNames.push_back(file.name);
     }
+    return true;
+}
 
-    // Iterate through the dictionary and remove entries that don't match all search terms
-    for (auto it = myDictionary.begin(); it != myDictionary.end(); ) {
-        std::string lowerCaseMetadata = it->second;
-        std::transform(lowerCaseMetadata.begin(), lowerCaseMetadata.end(), lowerCaseMetadata.begin(), ::tolower);
-
-        // Check if all words are in the metadata
-        bool allWordsFound = std::all_of(lowerCaseSearchWords.begin(), lowerCaseSearchWords.end(),
-            [&lowerCaseMetadata](const std::string& word) {
-                return lowerCaseMetadata.find(word) != std::string::npos;
-            });
+// Fill the store with metadata, only processing PNG files. Files are handed to the pool in batches,
+// each batch filling its own store so workers never contend on a lock, then the batches are appended in order
+void fillDictionaryWithImageMetadata(const std::string& folderPath, ImageStore& store, ThreadPool& pool, FileOrder order = FileOrder::Directory,
+                                     ReadMode readMode = ReadMode::Cached) {
+    // File names go to an arena of their own, which only lives as long as the scan
+    Arena nameArena;
+    std::vector<StrRef> fileNames;
+    if (!listPngFiles(folderPath, nameArena, fileNames, order)) return;
 
-        if (!allWordsFound) {
-            it = myDictionary.erase(it); // Erase and move to the next item
-        } else {
-            ++it; // Move to the next item if not erased
-        }
+    // The pool starts batches in the order they were queued, so in disk order small batches keep the workers on
+    // neighbouring files and the disk moves forward through the folder instead of serving one region per worker
+    const size_t INGEST_BATCH_SIZE = order == FileOrder::Physical ? 16 : 512;
+    std::vector<std::future<ImageStore>> futures; // To keep track of futures
+    for (size_t begin = 0; begin < fileNames.size(); begin += INGEST_BATCH_SIZE) {
+        size_t end = std::min(begin + INGEST_BATCH_SIZE, fileNames.size());
+        futures.push_back(pool.enqueue([&, begin, end]() {
+            ImageStore batch;
+            batch.compressed = store.compressed;
+            processFileBatch(folderPath, fileNames, begin, end, batch, readMode);
+            return batch;
+        }));
     }
+
+    // Wait for all batches to complete and append them
+    for (auto& f : futures) store.append(f.get());
 }
 
-// Function to move filtered images to a new or existing folder
-void moveFilteredImages(const std::unordered_map<std::string, std::string>& myDictionary, const std::string& folderPath) {
-    std::string filteredFolder = folderPath + "\\Filtered_Search";
+// Case-insensitive substring test against an already lowercased needle, without copying the text
+bool containsIgnoreCase(StrRef text, const std::string& lowerNeedle) {
+    if (lowerNeedle.empty()) return true;
+    const char* end = text.data + text.size;
+    return std::search(text.data, end, lowerNeedle.begin(), lowerNeedle.end(),
+        [](char a, char b) { return ::tolower((unsigned char)a) == b; }) != end;
+}
 
-    // Delete existing 'Filtered_Search' directory if it exists
-    if (DirectoryExists(filteredFolder.c_str())) {
-        RemoveDirectoryA(filteredFolder.c_str()); // Note: this only works if the directory is empty, 
-                                                  // for non-empty directories we need to use SHFileOperation
-        SHFILEOPSTRUCTA file_op = {
-            NULL,
-            FO_DELETE,
-            filteredFolder.c_str(),
-            "",
-            FOF_NOCONFIRMATION | FOF_NOERRORUI | FOF_SILENT,
-            false,
-            0,
-            ""
-        };
-        SHFileOperationA(&file_op);
+// Case-insensitive substring test against one tEXt entry seen as "keyword: value", which is how the metadata reads.
+// Search terms never hold a line break, so a match lies inside one value line or starts before the value, in which
+// case it fits in the keyword, the ": " and the first needle length - 1 bytes of the first line. Only that short head
+// is ever assembled
+bool entryContainsIgnoreCase(const ImageStore& store, size_t entry, const std::string& lowerNeedle) {
+    for (uint32_t l = store.lineBegin(entry); l < store.lineEnd(entry); ++l) {
+        if (containsIgnoreCase(store.line(l), lowerNeedle)) return true;
     }
 
-    // Create 'Filtered_Search' directory
-    if (!CreateDirectoryA(filteredFolder.c_str(), NULL)) {
-        if (GetLastError() != ERROR_ALREADY_EXISTS) {
-            std::cerr << "Failed to create directory: " << GetLastError() << std::endl;
-            return;
-        }
+    StrRef keyword = store.keyword(entry);
+    StrRef firstLine = store.line(store.lineBegin(entry));
+    char head[512];
+    size_t valuePart = std::min(firstLine.size, lowerNeedle.size() - 1);
+    size_t headLength = keyword.size + 2 + valuePart;
+    if (headLength > sizeof(head)) {
+        std::string longHead = keyword.str() + ": " + std::string(firstLine.data, valuePart);
+        return containsIgnoreCase(longHead, lowerNeedle);
     }
 
-    // Move filtered images to new directory
-    for (const auto& pair : myDictionary) {
-        std::string sourcePath = folderPath + "\\" + pair.first + ".png";
-        std::string destPath = filteredFolder + "\\" + pair.first + ".png";
+    memcpy(head, keyword.data, keyword.size);
+    memcpy(head + keyword.size, ": ", 2);
+    memcpy(head + keyword.size + 2, firstLine.data, valuePart);
+    return containsIgnoreCase(StrRef(head, headLength), lowerNeedle);
+}
 
-        if (!MoveFileA(sourcePath.c_str(), destPath.c_str())) {
-            std::cerr << "Failed to move file " << pair.first << ".png: " << GetLastError() << std::endl;
-        }
+// True when one of the image's tEXt entries contains the lowercased needle
+bool imageContainsIgnoreCase(const ImageStore& store, size_t id, const std::string& lowerNeedle) {
+    if (lowerNeedle.empty()) return true;
+    for (uint32_t e = store.entryBegin(id); e < store.entryEnd(id); ++e) {
+        if (entryContainsIgnoreCase(store, e, lowerNeedle)) return true;
     }
+    return false;
 }
 
-int main() {
-    int pngCount = 0;
-    std::string folderPath;
-    
+// Bit-parallel approximate matching after Myers: one machine word holds a column of the edit distance table, so each
+// text byte costs a handful of word operations whatever the number of edits allowed. Patterns are at most 64 bytes
+// and compared case-insensitively
+class FuzzyMatcher {
+private:
+    uint64_t positions[256]; // Per byte, bit i set when pattern byte i is that byte
+    uint64_t highBit = 0;
+    int length = 0;
 
-    std::cout << "\n This program serves to filter images of a given folder using the textual PNG metadata of said images.";
+public:
+    static const int MAX_LENGTH = 64;
 
-    // Loop for valid directory input
-    while (true) {
-        std::cout << "\nPlease enter a valid folder path: ";
-        std::getline(std::cin, folderPath);
+    // Column of the table carried from one fed byte to the next
+    struct State {
+        uint64_t plus;  // Rows where the distance goes up by one from the row above
+        uint64_t minus; // Rows where it goes down by one
+        int score;      // Distance in the last row
+    };
+
+    FuzzyMatcher() { memset(positions, 0, sizeof(positions)); }
 
-        if (DirectoryExists(folderPath.c_str())) break;
-        std::cout << "\nInvalid folder path, or the directory does not exist... \nPlease try again.\n";
+    explicit FuzzyMatcher(const std::string& lowerPattern) : FuzzyMatcher() {
+        length = (int)std::min<size_t>(lowerPattern.size(), MAX_LENGTH);
+        for (int i = 0; i < length; ++i) positions[(unsigned char)lowerPattern[i]] |= 1ull << i;
+        highBit = length ? 1ull << (length - 1) : 0;
     }
-    std::cout << "\n You have entered a valid folder path.";
-    std::cout << "\n There are " << countPngFiles(folderPath.c_str(), pngCount) << " .png files in that folder.";
 
-    // Create threadpool
-    ThreadPool pool(std::thread::hardware_concurrency());
+    State start() const {
+        return State{length == 64 ? ~0ull : (1ull << length) - 1, 0, length};
+    }
 
-    // Create an empty dictionary
-    std::unordered_map<std::string, std::string> myDictionary = createEmptyDictionary(pngCount);
-    std::cout << "\nA dictionary has been instantiated and has enough space for " << pngCount << " key/value pairs.";
+    // Feeds text to the state, true as soon as the pattern ends within 'maxEdits' edits somewhere in it.
+    // 'anchored' makes the pattern start at the first byte, for distances between whole strings
+    bool feed(State& state, const char* text, size_t size, int maxEdits, bool anchored = false) const {
+        for (size_t i = 0; i < size; ++i) {
+            uint64_t equal = positions[(unsigned char)::tolower((unsigned char)text[i])];
+            uint64_t vertical = equal | state.minus;
+            uint64_t horizontal = (((equal & state.plus) + state.plus) ^ state.plus) | equal;
+            uint64_t horizontalPlus = state.minus | ~(horizontal | state.plus);
+            uint64_t horizontalMinus = state.plus & horizontal;
+            if (horizontalPlus & highBit) ++state.score;
+            else if (horizontalMinus & highBit) --state.score;
+            horizontalPlus = (horizontalPlus << 1) | (anchored ? 1 : 0);
+            horizontalMinus <<= 1;
+            state.plus = horizontalMinus | ~(vertical | horizontalPlus);
+            state.minus = horizontalPlus & vertical;
+            if (!anchored && state.score <= maxEdits) return true;
+        }
+        return false;
+    }
 
-    myDictionary =  fillDictionaryWithImageMetadata(folderPath, myDictionary, pool);
-    std::cout << "Finished processing all files." << std::endl;
+    // Edit distance between the pattern and a whole string
+    int distanceTo(StrRef text) const {
+        State state = start();
+        feed(state, text.data, text.size, 0, true);
+        return state.score;
+    }
+};
 
-    // Search for metadata
-    std::string wordsToSearch;
-    std::cout << "\nPlease enter comma separated tags so the program knows what you are searching for: ";
-    std::getline(std::cin, wordsToSearch);
+// Regular expressions for /.../ search terms, compiled to an automaton that never backtracks: a Thompson NFA whose
+// state sets are turned into DFA states lazily, as the text needs them. Matching is case-insensitive, the NFA only
+// ever sees lowercase bytes. Supported: literals, '.', [classes] with ranges and negation, \d \w \s and their
+// negations, escapes, groups, '|', '*', '+', '?', {m}, {m,}, {m,n}, and the assertions ^ $ \b \B
+class RegexProgram {
+public:
+    enum Op { Bytes, Split, Jump, WordBoundary, NotWordBoundary, LineStart, LineEnd, Match };
 
-    // Return a vector of the words that were split
-    splitWordsToSearch(wordsToSearch);
-    std::cout << "\nYou are searching for: " << wordsToSearch;
+    // One NFA state. Bytes consumes a byte of its set and goes to 'out', Split goes to both 'out' and 'alternative'
+    struct Node {
+        Op op;
+        int out = -1;
+        int alternative = -1;
+        uint64_t bytes[4] = {0, 0, 0, 0};
 
-    std::vector<std::string> searchTerms = splitWordsToSearch(wordsToSearch);
+        bool has(unsigned char c) const { return (bytes[c >> 6] >> (c & 63)) & 1; }
+    };
 
-    // Get a filtered dictionary we can use to filter the folder and get the images that have the metadata we want
-    filterDictionary(myDictionary, searchTerms);
+    // Compiles the pattern, false with a message in 'error' when it isn't valid
+    bool compile(const std::string& pattern, std::string& error) {
+        source = pattern;
+        position = 0;
+        ast.clear();
+        nodes.clear();
+        int root = parseAlternation();
+        if (!parseError.empty() || position != source.size()) {
+            error = parseError.empty() ? "unexpected '" + std::string(1, source[position]) + "'" : parseError;
+            return false;
+        }
+        // Each bound is capped, but nested repetitions multiply, so the whole program gets a budget before it is built
+        const uint64_t MAX_PROGRAM_SIZE = 100000;
+        if (fragmentSize(root, MAX_PROGRAM_SIZE + 1) > MAX_PROGRAM_SIZE) {
+            error = "pattern too large, it would need more than " + std::to_string(MAX_PROGRAM_SIZE) + " states";
+            return false;
+        }
 
-    moveFilteredImages(myDictionary, folderPath);
+        Exits exits;
+        start = emitFragment(root, exits);
+        int match = addNode(Match);
+        connect(exits, match);
+        if (start < 0) start = match;
+
+        std::string run;
+        literals.clear();
+        collectLiterals(root, run);
+        flushLiteral(run);
+        return true;
+    }
+
+    const std::vector<Node>& program() const { return nodes; }
+    int startNode() const { return start; }
+
+    // Lowercase strings every match contains, usable to pick candidates before the automaton runs
+    const std::vector<std::string>& requiredLiterals() const { return literals; }
+
+private:
+    // Syntax tree, compiled once per use so that {m,n} can repeat a subexpression
+    enum Kind { Empty, Set, Concat, Alternate, Repeat, Assert };
+    struct AstNode {
+        Kind kind;
+        uint64_t bytes[4];
+        Op assertion;
+        std::vector<int> children;
+        int min = 0, max = 0; // Repeat bounds, max -1 for unbounded
+    };
+
+    std::string source;
+    size_t position = 0;
+    std::string parseError;
+    std::vector<AstNode> ast;
+    std::vector<Node> nodes;
+    int start = -1;
+    std::vector<std::string> literals;
+
+    int addAst(Kind kind) {
+        AstNode node;
+        node.kind = kind;
+        memset(node.bytes, 0, sizeof(node.bytes));
+        node.assertion = Match;
+        ast.push_back(node);
+        return (int)ast.size() - 1;
+    }
+
+    int addNode(Op op) {
+        Node node;
+        node.op = op;
+        nodes.push_back(node);
+        return (int)nodes.size() - 1;
+    }
+
+    static void addByte(uint64_t* bytes, unsigned char c) { bytes[c >> 6] |= 1ull << (c & 63); }
+
+    // Adds a byte and its other case, so that sets work on lowercased text
+    static void addFolded(uint64_t* bytes, unsigned char c) {
+        addByte(bytes, c);
+        addByte(bytes, (unsigned char)::tolower(c));
+        addByte(bytes, (unsigned char)::toupper(c));
+    }
+
+    static bool isWordByte(unsigned char c) { return ::isalnum(c) || c == '_'; }
+
+    // Fills a set for the class escapes \d \w \s and their negations, false for other letters
+    static bool classEscape(char letter, uint64_t* bytes) {
+        char lower = (char)::tolower((unsigned char)letter);
+        if (lower != 'd' && lower != 'w' && lower != 's') return false;
+        uint64_t set[4] = {0, 0, 0, 0};
+        for (int c = 0; c < 256; ++c) {
+            bool inSet = lower == 'd' ? ::isdigit(c) != 0 : lower == 'w' ? isWordByte((unsigned char)c) : ::isspace(c) != 0;
+            if (inSet) addByte(set, (unsigned char)c);
+        }
+        bool negated = letter != lower;
+        for (int i = 0; i < 4; ++i) bytes[i] |= negated ? ~set[i] : set[i];
+        return true;
+    }
+
+    static char escapedByte(char letter) {
+        switch (letter) {
+            case 'n': return '\n';
+            case 't': return '\t';
+            case 'r': return '\r';
+            default: return letter;
+        }
+    }
+
+    bool atEnd() const { return position >= source.size(); }
+
+    int parseAlternation() {
+        int first = parseConcatenation();
+        if (atEnd() || source[position] != '|') return first;
+        int node = addAst(Alternate);
+        ast[node].children.push_back(first);
+        while (!atEnd() && source[position] == '|') {
+            ++position;
+            int next = parseConcatenation();
+            ast[node].children.push_back(next);
+        }
+        return node;
+    }
+
+    int parseConcatenation() {
+        int node = addAst(Concat);
+        while (!atEnd() && source[position] != '|' && source[position] != ')' && parseError.empty()) {
+            int item = parseRepetition();
+            ast[node].children.push_back(item);
+        }
+        return node;
+    }
+
+    int parseRepetition() {
+        int atom = parseAtom();
+        while (!atEnd() && parseError.empty()) {
+            char c = source[position];
+            int min, max;
+            if (c == '*') { min = 0; max = -1; ++position; }
+            else if (c == '+') { min = 1; max = -1; ++position; }
+            else if (c == '?') { min = 0; max = 1; ++position; }
+            else if (c == '{' && parseBounds(min, max)) {}
+            else break;
+
+            if (ast[atom].kind == Assert) {
+                parseError = "nothing to repeat";
+                break;
+            }
+            int node = addAst(Repeat);
+            ast[node].children.push_back(atom);
+            ast[node].min = min;
+            ast[node].max = max;
+            atom = node;
+        }
+        return atom;
+    }
+
+    // Reads {m}, {m,} or {m,n}. A brace that doesn't start valid bounds is a literal
+    bool parseBounds(int& min, int& max) {
+        const int MAX_REPEAT = 1000;
+        size_t cursor = position + 1;
+        auto readNumber = [&](int& value) {
+            size_t begin = cursor;
+            value = 0;
+            while (cursor < source.size() && ::isdigit((unsigned char)source[cursor]) && value <= MAX_REPEAT)
+                value = value * 10 + (source[cursor++] - '0');
+            return cursor > begin;
+        };
+        if (!readNumber(min)) return false;
+        max = min;
+        if (cursor < source.size() && source[cursor] == ',') {
+            ++cursor;
+            if (!readNumber(max)) max = -1;
+        }
+        if (cursor >= source.size() || source[cursor] != '}') return false;
+        if (min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min)) {
+            parseError = "invalid repetition bounds";
+            return false;
+        }
+        position = cursor + 1;
+        return true;
+    }
+
+    int parseAtom() {
+        char c = source[position++];
+        int node;
+        switch (c) {
+            case '(': {
+                if (source.compare(position, 2, "?:") == 0) position += 2;
+                node = parseAlternation();
+                if (atEnd() || source[position] != ')') parseError = "missing ')'";
+                else ++position;
+                return node;
+            }
+            case '[':
+                return parseClass();
+            case '.':
+                node = addAst(Set);
+                for (int i = 0; i < 4; ++i) ast[node].bytes[i] = ~0ull;
+                ast[node].bytes[0] &= ~(1ull << '\n');
+                return node;
+            case '^':
+            case '$':
+                node = addAst(Assert);
+                ast[node].assertion = c == '^' ? LineStart : LineEnd;
+                return node;
+            case '*':
+            case '+':
+            case '?':
+                parseError = "nothing to repeat";
+                return addAst(Empty);
+            case '\\': {
+                if (atEnd()) {
+                    parseError = "trailing '\\'";
+                    return addAst(Empty);
+                }
+                char letter = source[position++];
+                if (letter == 'b' || letter == 'B') {
+                    node = addAst(Assert);
+                    ast[node].assertion = letter == 'b' ? WordBoundary : NotWordBoundary;
+                    return node;
+                }
+                node = addAst(Set);
+                if (!classEscape(letter, ast[node].bytes)) addFolded(ast[node].bytes, (unsigned char)escapedByte(letter));
+                return node;
+            }
+            default:
+                node = addAst(Set);
+                addFolded(ast[node].bytes, (unsigned char)c);
+                return node;
+        }
+    }
+
+    int parseClass() {
+        int node = addAst(Set);
+        uint64_t set[4] = {0, 0, 0, 0};
+        bool negated = !atEnd() && source[position] == '^';
+        if (negated) ++position;
+
+        bool first = true;
+        while (!atEnd() && (source[position] != ']' || first)) {
+            first = false;
+            unsigned char low = (unsigned char)source[position++];
+            if (low == '\\' && !atEnd()) {
+                char letter = source[position++];
+                if (classEscape(letter, set)) continue;
+                low = (unsigned char)escapedByte(letter);
+            }
+            unsigned char high = low;
+            if (position + 1 < source.size() && source[position] == '-' && source[position + 1] != ']') {
+                high = (unsigned char)source[position + 1];
+                position += 2;
+                if (high == '\\' && !atEnd()) high = (unsigned char)escapedByte(source[position++]);
+                if (high < low) {
+                    parseError = "invalid range in []";
+                    return node;
+                }
+            }
+            for (int b = low; b <= high; ++b) addFolded(set, (unsigned char)b);
+        }
+        if (atEnd()) {
+            parseError = "missing ']'";
+            return node;
+        }
+        ++position;
+        for (int i = 0; i < 4; ++i) ast[node].bytes[i] = negated ? ~set[i] : set[i];
+        return node;
+    }
+
+    // Thompson construction: exits are (node, through its alternative) pairs still to connect to what follows
+    typedef std::vector<std::pair<int, bool>> Exits;
+
+    void connect(const Exits& exits, int target) {
+        for (const auto& exit : exits) (exit.second ? nodes[exit.first].alternative : nodes[exit.first].out) = target;
+    }
+
+    // Number of nodes emitFragment adds for a fragment at most, counted no further than 'limit'
+    uint64_t fragmentSize(int index, uint64_t limit) const {
+        const AstNode& node = ast[index];
+        uint64_t size = 0;
+        switch (node.kind) {
+            case Empty:
+                return 0;
+            case Set:
+            case Assert:
+                return 1;
+            case Concat:
+                for (int child : node.children) size = std::min(limit, size + fragmentSize(child, limit));
+                return size;
+            case Alternate:
+                // A split per branch but the last, and a jump for every branch that matches only the empty string
+                for (int child : node.children) size = std::min(limit, size + 2 + fragmentSize(child, limit));
+                return size;
+            case Repeat: {
+                uint64_t child = fragmentSize(node.children[0], limit);
+                uint64_t copies = node.max < 0 ? (uint64_t)node.min + 1 : (uint64_t)node.max;
+                return std::min(limit, copies * (child + 1));
+            }
+        }
+        return size;
+    }
+
+    // Returns the entry node of the fragment, or -1 for one that matches only the empty string without assertions
+    int emitFragment(int index, Exits& exits) {
+        const AstNode& node = ast[index];
+        switch (node.kind) {
+            case Empty:
+                return -1;
+            case Set: {
+                int id = addNode(Bytes);
+                memcpy(nodes[id].bytes, node.bytes, sizeof(node.bytes));
+                exits.assign(1, std::make_pair(id, false));
+                return id;
+            }
+            case Assert: {
+                int id = addNode(node.assertion);
+                exits.assign(1, std::make_pair(id, false));
+                return id;
+            }
+            case Concat: {
+                int entry = -1;
+                Exits open;
+                for (int child : node.children) {
+                    Exits childExits;
+                    int childEntry = emitFragment(child, childExits);
+                    if (childEntry < 0) continue;
+                    if (entry < 0) entry = childEntry;
+                    else connect(open, childEntry);
+                    open.swap(childExits);
+                }
+                exits.swap(open);
+                return entry;
+            }
+            case Alternate: {
+                // A chain of splits, each choosing between one branch and the rest
+                int entry = -1, previousSplit = -1;
+                exits.clear();
+                for (size_t i = 0; i < node.children.size(); ++i) {
+                    Exits branchExits;
+                    int branch = emitFragment(node.children[i], branchExits);
+                    if (branch < 0) {
+                        branch = addNode(Jump);
+                        branchExits.assign(1, std::make_pair(branch, false));
+                    }
+                    int target = branch;
+                    if (i + 1 < node.children.size()) {
+                        target = addNode(Split);
+                        nodes[target].out = branch;
+                    }
+                    if (previousSplit >= 0) nodes[previousSplit].alternative = target;
+                    else entry = target;
+                    previousSplit = i + 1 < node.children.size() ? target : -1;
+                    exits.insert(exits.end(), branchExits.begin(), branchExits.end());
+                }
+                return entry;
+            }
+            case Repeat: {
+                // Mandatory copies first, then either a loop or the optional copies
+                int entry = -1;
+                Exits open;
+                auto append = [&](int fragmentEntry, Exits& fragmentExits) {
+                    if (entry < 0) entry = fragmentEntry;
+                    else connect(open, fragmentEntry);
+                    open.swap(fragmentExits);
+                };
+                for (int i = 0; i < node.min; ++i) {
+                    Exits childExits;
+                    int childEntry = emitFragment(node.children[0], childExits);
+                    if (childEntry < 0) break;
+                    append(childEntry, childExits);
+                }
+                if (node.max < 0) {
+                    int split = addNode(Split);
+                    Exits childExits;
+                    int childEntry = emitFragment(node.children[0], childExits);
+                    if (childEntry < 0) childEntry = split;
+                    nodes[split].out = childEntry;
+                    connect(childExits, split);
+                    Exits splitExit(1, std::make_pair(split, true));
+                    append(split, splitExit);
+                } else {
+                    Exits skipped;
+                    for (int i = node.min; i < node.max; ++i) {
+                        int split = addNode(Split);
+                        Exits childExits;
+                        int childEntry = emitFragment(node.children[0], childExits);
+                        if (childEntry < 0) break;
+                        nodes[split].out = childEntry;
+                        skipped.push_back(std::make_pair(split, true));
+                        append(split, childExits);
+                    }
+                    open.insert(open.end(), skipped.begin(), skipped.end());
+                }
+                exits.swap(open);
+                return entry;
+            }
+        }
+        return -1;
+    }
+
+    // Single byte a set stands for once case is ignored, -1 when it has several
+    static int singleFoldedByte(const uint64_t* bytes) {
+        int found = -1;
+        for (int c = 0; c < 256; ++c) {
+            if (!((bytes[c >> 6] >> (c & 63)) & 1)) continue;
+            int lower = ::tolower(c);
+            if (found >= 0 && found != lower) return -1;
+            found = lower;
+        }
+        return found;
+    }
+
+    void flushLiteral(std::string& run) {
+        if (run.size() >= 3) literals.push_back(run);
+        run.clear();
+    }
+
+    // Walks the mandatory part of the tree: runs of single bytes that are always consecutive become literals
+    void collectLiterals(int index, std::string& run) {
+        const AstNode& node = ast[index];
+        switch (node.kind) {
+            case Empty:
+            case Assert:
+                return;
+            case Set: {
+                int c = singleFoldedByte(node.bytes);
+                if (c < 0) flushLiteral(run);
+                else run += (char)c;
+                return;
+            }
+            case Concat:
+                for (int child : node.children) collectLiterals(child, run);
+                return;
+            case Alternate:
+                flushLiteral(run);
+                return;
+            case Repeat:
+                flushLiteral(run);
+                if (node.min > 0) {
+                    collectLiterals(node.children[0], run);
+                    flushLiteral(run);
+                }
+                return;
+        }
+    }
+};
+
+// DFA built lazily over a RegexProgram. A DFA state is the set of NFA states reached, whether the last byte was a
+// word byte and whether the line has just started; the assertions are resolved while following the epsilon moves
+// before the next byte, when the bytes on both sides of the position are known. Each thread uses its own
+class LazyDfa {
+private:
+    static const int32_t UNKNOWN = -1;
+    static const int32_t MATCHED = -2;
+    static const size_t MAX_STATES = 4096; // The cache is dropped and refilled past this many states
+
+    std::shared_ptr<const RegexProgram> program;
+    const RegexProgram& regex;
+    std::vector<std::string> keys;          // Per DFA state, its NFA states and flags
+    std::vector<int32_t> transitions;       // 256 per DFA state
+    std::vector<int8_t> matchesAtLineEnd;   // Per DFA state, -1 until known
+    std::unordered_map<std::string, int32_t> stateIds;
+    int32_t startState = UNKNOWN;
+    std::vector<int> stack;
+    std::vector<uint32_t> seen;             // NFA state -> generation it was last visited in
+    uint32_t generation = 0;
+    uint32_t flushes = 0;
+
+    // Key layout: one flag byte, then the NFA states as 4 byte integers
+    static const char PREVIOUS_WORD = 1;
+    static const char LINE_START = 2;
+
+    int32_t intern(const std::string& key) {
+        auto found = stateIds.find(key);
+        if (found != stateIds.end()) return found->second;
+        if (keys.size() >= MAX_STATES) {
+            ++flushes;
+            keys.clear();
+            transitions.clear();
+            matchesAtLineEnd.clear();
+            stateIds.clear();
+            startState = UNKNOWN;
+        }
+        int32_t id = (int32_t)keys.size();
+        keys.push_back(key);
+        transitions.resize(transitions.size() + 256, (int32_t)UNKNOWN);
+        matchesAtLineEnd.push_back(-1);
+        stateIds.emplace(key, id);
+        return id;
+    }
+
+    // Follows the epsilon moves from the state's NFA states plus the start, for a position between a byte of
+    // the given kind and the next one. Returns true if the match state is reached, 'reached' gets the byte states
+    bool closure(const std::string& key, bool nextIsWord, bool atLineEnd, std::vector<int>& reached) {
+        const std::vector<RegexProgram::Node>& nodes = regex.program();
+        const bool previousIsWord = (key[0] & PREVIOUS_WORD) != 0;
+        const bool atLineStart = (key[0] & LINE_START) != 0;
+        if (seen.size() != nodes.size()) seen.assign(nodes.size(), 0);
+        if (++generation == 0) {
+            std::fill(seen.begin(), seen.end(), 0);
+            generation = 1;
+        }
+
+        reached.clear();
+        stack.clear();
+        stack.push_back(regex.startNode()); // Unanchored search: a match may start anywhere
+        for (size_t i = 1; i + 4 <= key.size(); i += 4) {
+            int node;
+            memcpy(&node, key.data() + i, 4);
+            stack.push_back(node);
+        }
+
+        bool matched = false;
+        while (!stack.empty()) {
+            int id = stack.back();
+            stack.pop_back();
+            if (id < 0 || seen[id] == generation) continue;
+            seen[id] = generation;
+            const RegexProgram::Node& node = nodes[id];
+            switch (node.op) {
+                case RegexProgram::Bytes: reached.push_back(id); break;
+                case RegexProgram::Match: matched = true; break;
+                case RegexProgram::Jump: stack.push_back(node.out); break;
+                case RegexProgram::Split:
+                    stack.push_back(node.alternative);
+                    stack.push_back(node.out);
+                    break;
+                case RegexProgram::WordBoundary: if (previousIsWord != nextIsWord) stack.push_back(node.out); break;
+                case RegexProgram::NotWordBoundary: if (previousIsWord == nextIsWord) stack.push_back(node.out); break;
+                case RegexProgram::LineStart: if (atLineStart) stack.push_back(node.out); break;
+                case RegexProgram::LineEnd: if (atLineEnd) stack.push_back(node.out); break;
+            }
+        }
+        return matched;
+    }
+
+    static bool isWordByte(unsigned char c) { return ::isalnum(c) || c == '_'; }
+
+    std::vector<int> reached;
+    std::string nextKey;
+
+    // Computes and caches the move from 'state' on the lowercase byte 'c'
+    int32_t transition(int32_t state, unsigned char c) {
+        bool nextIsWord = isWordByte(c);
+        if (closure(keys[state], nextIsWord, false, reached)) {
+            transitions[state * 256 + c] = MATCHED;
+            return MATCHED;
+        }
+
+        const std::vector<RegexProgram::Node>& nodes = regex.program();
+        nextKey.assign(1, nextIsWord ? PREVIOUS_WORD : 0);
+        std::sort(reached.begin(), reached.end());
+        for (int id : reached) {
+            if (nodes[id].has(c) && nodes[id].out >= 0) nextKey.append((const char*)&nodes[id].out, 4);
+        }
+        uint32_t flushesBefore = flushes;
+        int32_t next = intern(nextKey);
+        if (flushes == flushesBefore) transitions[state * 256 + c] = next; // Otherwise 'state' is gone
+        return next;
+    }
+
+public:
+    explicit LazyDfa(std::shared_ptr<const RegexProgram> program) : program(program), regex(*program) {}
+
+    // State at the start of a line
+    int32_t start() {
+        if (startState == UNKNOWN) startState = intern(std::string(1, LINE_START));
+        return startState;
+    }
+
+    // Feeds text to the state, true as soon as a match has been seen
+    bool feed(int32_t& state, const char* text, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            unsigned char c = (unsigned char)::tolower((unsigned char)text[i]);
+            int32_t next = transitions[state * 256 + c];
+            if (next == UNKNOWN) next = transition(state, c);
+            if (next == MATCHED) return true;
+            state = next;
+        }
+        return false;
+    }
+
+    // True if the line ending in this state holds a match that ends at its end
+    bool endLine(int32_t state) {
+        if (matchesAtLineEnd[state] < 0) matchesAtLineEnd[state] = closure(keys[state], false, true, reached) ? 1 : 0;
+        return matchesAtLineEnd[state] == 1;
+    }
+};
+
+// One comma separated part of a search. By default it must appear as a substring, ignoring case. With a trailing ~N,
+// like masterpiece~2, it may appear with up to N inserted, deleted or replaced bytes. Between slashes, like
+// /seed: 12[0-9]{3}\b/, it is a regular expression. Between double quotes, like "red dress", it is a phrase: its words
+// must appear in a row as whole words, punctuation aside. Phrases or words joined by NEAR/n, like
+// "red dress" NEAR/5 forest, must appear on one line with at most n words between each and the next
+struct SearchTerm {
+    enum Kind { Substring, Fuzzy, Regex, Phrase };
+    static const uint32_t MAX_NEAR_DISTANCE = 1000;
+
+    Kind kind = Substring;
+    std::string text;  // Lowercased, the pattern as written for a regular expression
+    int maxEdits = 0;  // Fuzzy terms only
+    FuzzyMatcher fuzzy;
+    std::shared_ptr<const RegexProgram> regex;
+    uint64_t regexSerial = 0;                  // Tells the programs apart in the per thread automaton caches
+    std::vector<std::string> tokens;           // Distinct words of a phrase term
+    std::vector<std::vector<size_t>> operands; // Words of each phrase joined by NEAR, as indices into 'tokens'
+    std::vector<uint32_t> nearDistances;       // Words allowed between each operand and the next
+    std::string error;                         // Why the term is not valid, empty when it is
+
+    explicit SearchTerm(const std::string& word) : text(word) {
+        if (text.size() >= 2 && text.front() == '/' && text.back() == '/') {
+            std::shared_ptr<RegexProgram> program = std::make_shared<RegexProgram>();
+            text = text.substr(1, text.size() - 2);
+            if (program->compile(text, error)) {
+                static std::atomic<uint64_t> serials(0);
+                kind = Regex;
+                regex = program;
+                regexSerial = ++serials;
+            }
+            return;
+        }
+
+        std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+        if (parsePhrases(word)) return;
+        size_t tilde = text.rfind('~');
+        if (tilde != std::string::npos && tilde + 1 < text.size() && tilde + 3 >= text.size() &&
+            std::all_of(text.begin() + tilde + 1, text.end(), ::isdigit)) {
+            int edits = atoi(text.c_str() + tilde + 1);
+            // Fuzzy terms need at least one exact byte and fit in one machine word, others stay plain substrings
+            if (edits > 0 && (int)tilde > edits && tilde <= (size_t)FuzzyMatcher::MAX_LENGTH) {
+                text.resize(tilde);
+                kind = Fuzzy;
+                maxEdits = edits;
+                fuzzy = FuzzyMatcher(text);
+            }
+        }
+    }
+
+    bool isExact() const { return kind == Substring; }
+
+    // Lowercase strings every image matching the term holds, for the signature and index filters
+    std::vector<std::string> requiredSubstrings() const {
+        if (kind == Regex) return regex->requiredLiterals();
+        if (kind == Phrase) return tokens;
+        if (kind == Substring) return std::vector<std::string>(1, text);
+        return std::vector<std::string>();
+    }
+
+    // True when the image's metadata, seen as "keyword: value" per entry, holds the term
+    bool matches(const ImageStore& store, size_t id) const {
+        if (kind == Substring) return imageContainsIgnoreCase(store, id, text);
+        if (kind == Regex) return regexMatches(store, id);
+        if (kind == Phrase) return phraseMatches(store, id);
+
+        // Like substrings, approximate matches stay within one line of a value, the first line following its keyword
+        for (uint32_t e = store.entryBegin(id); e < store.entryEnd(id); ++e) {
+            FuzzyMatcher::State state = fuzzy.start();
+            StrRef keyword = store.keyword(e);
+            if (fuzzy.feed(state, keyword.data, keyword.size, maxEdits) || fuzzy.feed(state, ": ", 2, maxEdits)) return true;
+            for (uint32_t l = store.lineBegin(e); l < store.lineEnd(e); ++l) {
+                if (l != store.lineBegin(e)) state = fuzzy.start();
+                StrRef line = store.line(l);
+                if (fuzzy.feed(state, line.data, line.size, maxEdits)) return true;
+            }
+        }
+        return false;
+    }
+
+    // True when a phrase term holds given the sorted positions of each of its words, in one line or one image
+    // whose lines are far enough apart. Spans matching the operands so far are extended one operand at a time
+    bool matchesPositions(const std::vector<std::vector<uint32_t>>& positions) const {
+        std::vector<std::pair<uint32_t, uint32_t>> spans, occurrences, extended; // (first word, last word)
+        for (size_t o = 0; o < operands.size(); ++o) {
+            const std::vector<size_t>& words = operands[o];
+            occurrences.clear();
+            for (uint32_t first : positions[words[0]]) {
+                bool inARow = true;
+                for (size_t w = 1; w < words.size() && inARow; ++w)
+                    inARow = std::binary_search(positions[words[w]].begin(), positions[words[w]].end(), first + (uint32_t)w);
+                if (inARow) occurrences.emplace_back(first, first + (uint32_t)words.size() - 1);
+            }
+            if (o == 0) {
+                spans.swap(occurrences);
+            } else {
+                extended.clear();
+                for (const auto& span : spans) {
+                    for (const auto& occurrence : occurrences) {
+                        uint32_t between;
+                        if (occurrence.first > span.second) between = occurrence.first - span.second - 1;
+                        else if (span.first > occurrence.second) between = span.first - occurrence.second - 1;
+                        else continue; // Operands don't share words
+                        if (between <= nearDistances[o - 1])
+                            extended.emplace_back(std::min(span.first, occurrence.first), std::max(span.second, occurrence.second));
+                    }
+                }
+                std::sort(extended.begin(), extended.end());
+                extended.erase(std::unique(extended.begin(), extended.end()), extended.end());
+                spans.swap(extended);
+            }
+            if (spans.empty()) return false;
+        }
+        return true;
+    }
+
+private:
+    // Reads a quoted phrase or phrases joined by NEAR/n, true when the word is one. Operands are split outside
+    // quotes only, so a quoted phrase may hold the word NEAR
+    bool parsePhrases(const std::string& word) {
+        std::vector<std::string> parts(1);
+        bool quoted = false;
+        for (size_t i = 0; i < word.size(); ++i) {
+            if (word[i] == '"') quoted = !quoted;
+            if (!quoted && word.compare(i, 6, " NEAR/") == 0) {
+                size_t digits = i + 6, after = digits;
+                while (after < word.size() && ::isdigit((unsigned char)word[after]) && after - digits < 5) ++after;
+                if (after > digits && after < word.size() && word[after] == ' ') {
+                    uint32_t distance = (uint32_t)atoi(word.c_str() + digits);
+                    if (distance > MAX_NEAR_DISTANCE) error = "NEAR distances go up to " + std::to_string(MAX_NEAR_DISTANCE);
+                    nearDistances.push_back(distance);
+                    parts.emplace_back();
+                    i = after;
+                    continue;
+                }
+            }
+            parts.back() += word[i];
+        }
+        if (parts.size() == 1 && (word.size() < 2 || word.front() != '"' || word.back() != '"')) return false;
+
+        std::string token;
+        for (auto& part : parts) {
+            size_t first = part.find_first_not_of(' '), last = part.find_last_not_of(' ');
+            part = first == std::string::npos ? "" : part.substr(first, last - first + 1);
+            if (part.size() >= 2 && part.front() == '"' && part.back() == '"') part = part.substr(1, part.size() - 2);
+
+            operands.emplace_back();
+            forEachToken(part.data(), part.size(), token, [&](StrRef value, size_t) {
+                size_t t = 0;
+                while (t < tokens.size() && (tokens[t].size() != value.size || memcmp(tokens[t].data(), value.data, value.size) != 0)) ++t;
+                if (t == tokens.size()) tokens.push_back(value.str());
+                operands.back().push_back(t);
+            });
+            if (operands.back().empty() && error.empty()) error = "\"" + part + "\" has no words to look for";
+        }
+        if (!error.empty() && parts.size() == 1) {
+            // A quoted tag without words, like "!!", stays a substring
+            text = text.substr(1, text.size() - 2);
+            error.clear();
+            tokens.clear();
+            operands.clear();
+            return true;
+        }
+        kind = Phrase;
+        return true;
+    }
+
+    // Words of the phrase are looked for as substrings first, only images holding all of them are tokenized
+    bool phraseMatches(const ImageStore& store, size_t id) const {
+        for (const auto& token : tokens) {
+            if (!imageContainsIgnoreCase(store, id, token)) return false;
+        }
+
+        std::vector<std::vector<uint32_t>> positions(tokens.size());
+        std::string scratch;
+        uint32_t position = 0;
+        auto addToken = [&](StrRef value, size_t) {
+            for (size_t t = 0; t < tokens.size(); ++t) {
+                if (tokens[t].size() == value.size && memcmp(tokens[t].data(), value.data, value.size) == 0) positions[t].push_back(position);
+            }
+            ++position;
+        };
+        auto lineMatches = [&]() {
+            bool matched = matchesPositions(positions);
+            for (auto& list : positions) list.clear();
+            position = 0;
+            return matched;
+        };
+        for (uint32_t e = store.entryBegin(id); e < store.entryEnd(id); ++e) {
+            StrRef keyword = store.keyword(e);
+            forEachToken(keyword.data, keyword.size, scratch, addToken);
+            if (store.lineBegin(e) == store.lineEnd(e) && lineMatches()) return true;
+            for (uint32_t l = store.lineBegin(e); l < store.lineEnd(e); ++l) {
+                StrRef line = store.line(l);
+                forEachToken(line.data, line.size, scratch, addToken);
+                if (lineMatches()) return true;
+            }
+        }
+        return false;
+    }
+
+    // The automaton of this thread for the program, its states are built as the images need them
+    LazyDfa& threadDfa() const {
+        static thread_local std::unordered_map<uint64_t, std::unique_ptr<LazyDfa>> automata;
+        std::unique_ptr<LazyDfa>& dfa = automata[regexSerial];
+        if (!dfa) dfa.reset(new LazyDfa(regex));
+        return *dfa;
+    }
+
+    // Lines are matched one at a time like for the other kinds, ^ and $ stand for their ends
+    bool regexMatches(const ImageStore& store, size_t id) const {
+        LazyDfa& dfa = threadDfa();
+        for (uint32_t e = store.entryBegin(id); e < store.entryEnd(id); ++e) {
+            int32_t state = dfa.start();
+            StrRef keyword = store.keyword(e);
+            if (dfa.feed(state, keyword.data, keyword.size) || dfa.feed(state, ": ", 2)) return true;
+            for (uint32_t l = store.lineBegin(e); l < store.lineEnd(e); ++l) {
+                if (l != store.lineBegin(e)) state = dfa.start();
+                StrRef line = store.line(l);
+                if (dfa.feed(state, line.data, line.size) || dfa.endLine(state)) return true;
+            }
+            if (store.lineBegin(e) == store.lineEnd(e) && dfa.endLine(state)) return true;
+        }
+        return false;
+    }
+};
+
+// Parses the split search words into terms
+std::vector<SearchTerm> parseSearchTerms(const std::vector<std::string>& wordsToSearch) {
+    std::vector<SearchTerm> terms;
+    for (const auto& word : wordsToSearch) terms.emplace_back(word);
+    return terms;
+}
+
+// True when the image matches every term
+bool imageMatchesAll(const ImageStore& store, size_t id, const std::vector<SearchTerm>& terms) {
+    return std::all_of(terms.begin(), terms.end(), [&store, id](const SearchTerm& term) { return term.matches(store, id); });
+}
+
+// Trigram hashes every image matching the terms must hold, from the substrings they require
+std::vector<uint64_t> requiredTrigramHashes(const std::vector<SearchTerm>& terms) {
+    std::vector<uint64_t> trigramHashes;
+    for (const auto& term : terms) {
+        for (const auto& substring : term.requiredSubstrings()) {
+            std::vector<uint64_t> termHashes = termTrigramHashes(substring);
+            trigramHashes.insert(trigramHashes.end(), termHashes.begin(), termHashes.end());
+        }
+    }
+    std::sort(trigramHashes.begin(), trigramHashes.end());
+    trigramHashes.erase(std::unique(trigramHashes.begin(), trigramHashes.end()), trigramHashes.end());
+    return trigramHashes;
+}
+
+// Function to filter the store based on search terms, returns the indices of the images that match all of them
+std::vector<uint32_t> filterDictionary(const ImageStore& store, const std::vector<std::string>& wordsToSearch) {
+    std::vector<SearchTerm> terms = parseSearchTerms(wordsToSearch);
+
+    // Trigrams every matching image must hold, probed against its signature before any text is read
+    std::vector<uint64_t> trigramHashes = requiredTrigramHashes(terms);
+
+    // Keep the images whose metadata contains all search terms
+    std::vector<uint32_t> matches;
+    ImageReader reader;
+    for (uint32_t id = 0; id < store.size(); ++id) {
+        if (!store.mayContain(id, trigramHashes)) continue;
+
+        size_t viewId;
+        const ImageStore& image = reader.open(store, id, viewId);
+        if (imageMatchesAll(image, viewId, terms)) matches.push_back(id);
+    }
+    return matches;
+}
+
+// Function to count the indices in [0, count) for which 'matchesAt(i, reader, scratch)' holds, without keeping
+// them. Batches run on the pool and only add to a counter each, and with 'stopAtFirst' every batch gives up once any
+// match was found, which is all an existence check needs
+template<class MatchesAt>
+size_t countInBatches(size_t count, ThreadPool& pool, bool stopAtFirst, MatchesAt matchesAt) {
+    const size_t COUNT_BATCH_SIZE = 4096;
+    std::atomic<bool> found(false);
+    std::vector<std::future<size_t>> futures;
+    for (size_t begin = 0; begin < count; begin += COUNT_BATCH_SIZE) {
+        size_t end = std::min(begin + COUNT_BATCH_SIZE, count);
+        futures.push_back(pool.enqueue([&, begin, end]() {
+            size_t matched = 0;
+            ImageReader reader;
+            std::string scratch;
+            for (size_t i = begin; i < end && !(stopAtFirst && found.load(std::memory_order_relaxed)); ++i) {
+                if (!matchesAt(i, reader, scratch)) continue;
+                ++matched;
+                if (stopAtFirst) found = true;
+            }
+            return matched;
+        }));
+    }
+    size_t total = 0;
+    for (auto& f : futures) total += f.get();
+    return total;
+}
+
+// Function to count the images of the store matching every search term, the store is only read
+size_t countMatches(const ImageStore& store, const std::vector<std::string>& wordsToSearch, ThreadPool& pool, bool stopAtFirst) {
+    std::vector<SearchTerm> terms = parseSearchTerms(wordsToSearch);
+    std::vector<uint64_t> trigramHashes = requiredTrigramHashes(terms);
+    return countInBatches(store.size(), pool, stopAtFirst, [&](size_t id, ImageReader& reader, std::string&) {
+        if (!store.mayContain(id, trigramHashes)) return false;
+        size_t viewId;
+        const ImageStore& image = reader.open(store, id, viewId);
+        return imageMatchesAll(image, viewId, terms);
+    });
+}
+
+// Bounds of a scan that filters as it goes, either may be left unset
+struct ScanLimits {
+    FileOrder order = FileOrder::Directory; // Files read first are the ones whose matches are kept
+    ReadMode readMode = ReadMode::Cached;
+    size_t maxMatches = 0;  // Stop once this many matches were found, 0 for no limit
+    bool hasDeadline = false;
+    std::chrono::steady_clock::time_point deadline; // Stop when this time comes, with the matches found so far
+};
+
+// Function to scan the folder and filter it in the same pass, until every file was read or one of the limits was
+// reached. Only the matches are kept in the store, and their indices are returned. Every worker takes the next
+// chunk of a few files from a shared cursor, so chunks are read in the order of the listing, and looks at a stop
+// token between files. Matches are only kept for the chunks before the first one that was not read completely, so
+// they are always the first ones in that order: a limit stops the scan once that prefix holds enough of them, and
+// a deadline keeps whatever prefix was read. 'progress' receives the fraction of the files of that prefix
+std::vector<uint32_t> scanMatches(const std::string& folderPath, const std::vector<std::string>& wordsToSearch, const ScanLimits& limits,
+                                  ImageStore& store, ThreadPool& pool, double& progress) {
+    const size_t CHUNK_SIZE = 16; // Files handed out at once
+    std::vector<uint32_t> matches;
+    progress = 1;
+    Arena nameArena;
+    std::vector<StrRef> fileNames;
+    if (!listPngFiles(folderPath, nameArena, fileNames, limits.order) || fileNames.empty()) return matches;
+
+    std::vector<SearchTerm> terms = parseSearchTerms(wordsToSearch);
+    std::vector<uint64_t> trigramHashes = requiredTrigramHashes(terms);
+    StopToken stop;
+    auto stopScan = [&pool, stop]() {
+        stop.requestStop();
+        pool.cancelPending();
+    };
+
+    const size_t chunkCount = (fileNames.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::atomic<size_t> nextChunk(0);
+    std::mutex prefixMutex;
+    std::vector<char> chunkDone(chunkCount, 0);        // Guarded by prefixMutex
+    std::vector<uint32_t> chunkMatches(chunkCount, 0); // Matches of each finished chunk
+    size_t prefixChunks = 0, prefixMatches = 0;        // Chunks finished without a gap from the first one, their matches
+
+    // Per worker, its matches and the chunk each one came from. A worker takes chunks in increasing order
+    struct WorkerMatches {
+        ImageStore images;
+        std::vector<size_t> chunks;
+    };
+    std::vector<std::future<WorkerMatches>> futures;
+    for (size_t worker = 0; worker < std::min(pool.threadCount(), chunkCount); ++worker) {
+        futures.push_back(pool.enqueue([&]() {
+            WorkerMatches found;
+            ImageStore chunk;
+            for (size_t c; !stop.stopRequested() && (c = nextChunk++) < chunkCount;) {
+                if (limits.hasDeadline && std::chrono::steady_clock::now() >= limits.deadline) {
+                    stopScan();
+                    break;
+                }
+                size_t begin = c * CHUNK_SIZE, end = std::min(begin + CHUNK_SIZE, fileNames.size());
+                chunk.clear();
+                processFileBatch(folderPath, fileNames, begin, end, chunk, limits.readMode);
+
+                uint32_t id = 0, matched = 0;
+                for (; id < chunk.size() && !stop.stopRequested(); ++id) {
+                    if (!chunk.mayContain(id, trigramHashes) || !imageMatchesAll(chunk, id, terms)) continue;
+                    found.images.addImage(chunk.title(id));
+                    for (uint32_t e = chunk.entryBegin(id); e < chunk.entryEnd(id); ++e) found.images.addEntry(chunk.keyword(e), chunk.value(e));
+                    found.images.addSignatureWords(chunk.signatureWords.data() + chunk.signatureOffsets[id],
+                                                   chunk.signatureOffsets[id + 1] - chunk.signatureOffsets[id]);
+                    found.chunks.push_back(c);
+                    ++matched;
+                }
+                if (id < chunk.size()) break; // Stopped inside the chunk, which so ends the prefix
+
+                std::lock_guard<std::mutex> lock(prefixMutex);
+                chunkDone[c] = 1;
+                chunkMatches[c] = matched;
+                while (prefixChunks < chunkCount && chunkDone[prefixChunks]) prefixMatches += chunkMatches[prefixChunks++];
+                if (limits.maxMatches > 0 && prefixMatches >= limits.maxMatches) stopScan();
+            }
+            return found;
+        }));
+    }
+
+    // Workers only see the deadline between files, waiting for it here also stops them when a chunk is slow
+    std::vector<WorkerMatches> workers;
+    for (auto& f : futures) {
+        if (limits.hasDeadline && f.wait_until(limits.deadline) == std::future_status::timeout) stopScan();
+        try {
+            workers.push_back(f.get());
+        } catch (const std::future_error&) {
+        }
+    }
+
+    // Matches of the prefix go to the store in the order of their chunks, each chunk comes from a single worker
+    std::vector<std::pair<size_t, std::pair<size_t, uint32_t>>> ordered; // (chunk, (worker, id))
+    for (size_t w = 0; w < workers.size(); ++w) {
+        for (uint32_t id = 0; id < workers[w].chunks.size(); ++id)
+            if (workers[w].chunks[id] < prefixChunks) ordered.push_back(std::make_pair(workers[w].chunks[id], std::make_pair(w, id)));
+    }
+    std::sort(ordered.begin(), ordered.end());
+    if (limits.maxMatches > 0 && ordered.size() > limits.maxMatches) ordered.resize(limits.maxMatches);
+    for (const auto& match : ordered) {
+        const ImageStore& images = workers[match.second.first].images;
+        uint32_t id = match.second.second;
+        store.addImage(images.title(id));
+        for (uint32_t e = images.entryBegin(id); e < images.entryEnd(id); ++e) store.addEntry(images.keyword(e), images.value(e));
+        store.addSignatureWords(images.signatureWords.data() + images.signatureOffsets[id],
+                                images.signatureOffsets[id + 1] - images.signatureOffsets[id]);
+    }
+
+    progress = (double)std::min(prefixChunks * CHUNK_SIZE, fileNames.size()) / fileNames.size();
+    matches.resize(store.size());
+    std::iota(matches.begin(), matches.end(), 0);
+    return matches;
+}
+
+// Function to write the text a printing mode produced to the output file if one was given, else to standard output
+void writeResults(const std::string& text, const SearchOptions& options) {
+    FILE* out = stdout;
+    if (!options.outputFile.empty()) {
+        out = fopen(options.outputFile.c_str(), "wb");
+        if (!out) {
+            std::cerr << "Failed to open output file " << options.outputFile << std::endl;
+            return;
+        }
+    } else {
+        std::cout.flush();
+    }
+
+    fwrite(text.data(), 1, text.size(), out);
+    if (out != stdout) fclose(out);
+    else fflush(out);
+}
+
+// Set by Ctrl+C or Ctrl+Break while an estimate is refined, the estimate then stops after the current batches
+std::atomic<bool> estimateInterrupted(false);
+
+BOOL WINAPI interruptEstimate(DWORD controlType) {
+    if (controlType != CTRL_C_EVENT && controlType != CTRL_BREAK_EVENT) return FALSE;
+    estimateInterrupted = true;
+    return TRUE;
+}
+
+// Wilson score interval at 95% confidence for the number of matches among 'total' images, given 'matched' of
+// 'sampled' random ones. Sampling without replacement shrinks the variance by the finite population correction,
+// and the bounds never go below the matches seen or above what the non-matches seen leave
+void estimateInterval(size_t matched, size_t sampled, size_t total, double& estimate, double& low, double& high) {
+    const double Z = 1.96;
+    estimate = sampled ? (double)matched / sampled * total : 0;
+    low = high = estimate;
+    if (sampled == 0 || sampled >= total) return;
+
+    double p = (double)matched / sampled;
+    double n = sampled * (double)(total - 1) / (total - sampled);
+    double denominator = 1 + Z * Z / n;
+    double center = (p + Z * Z / (2 * n)) / denominator;
+    double halfWidth = Z * std::sqrt(p * (1 - p) / n + Z * Z / (4 * n * n)) / denominator;
+    low = std::max((double)matched, (center - halfWidth) * total);
+    high = std::min((double)(total - (sampled - matched)), (center + halfWidth) * total);
+}
+
+// Function to estimate how many images of the folder match every search term from a random sample of its files.
+// Files are read in a shuffled order through the usual batches, in rounds that double in size, and the estimate
+// with its confidence interval is printed after each round. It goes on until every file was read or Ctrl+C is
+// pressed, and the last estimate is written to --out-file or standard output as "estimate<TAB>low<TAB>high<TAB>sampled<TAB>total"
+void estimateMatches(const std::string& folderPath, const std::vector<std::string>& wordsToSearch, const SearchOptions& options,
+                     ThreadPool& pool, std::ostream& console) {
+    const size_t FIRST_ROUND_SIZE = 256;
+    const size_t SAMPLE_BATCH_SIZE = 64;
+    Arena nameArena;
+    std::vector<StrRef> fileNames;
+    if (!listPngFiles(folderPath, nameArena, fileNames)) return;
+
+    std::vector<SearchTerm> terms = parseSearchTerms(wordsToSearch);
+    std::vector<uint64_t> trigramHashes = requiredTrigramHashes(terms);
+    std::mt19937_64 random(std::random_device{}());
+    estimateInterrupted = false;
+    SetConsoleCtrlHandler(interruptEstimate, TRUE);
+
+    size_t sampled = 0, matched = 0;
+    double estimate = 0, low = 0, high = 0;
+    for (size_t roundSize = FIRST_ROUND_SIZE; sampled < fileNames.size() && !estimateInterrupted; roundSize *= 2) {
+        // The files of this round are drawn by continuing a Fisher-Yates shuffle, the sample so far stays in front
+        size_t end = std::min(sampled + roundSize, fileNames.size());
+        for (size_t i = sampled; i < end; ++i)
+            std::swap(fileNames[i], fileNames[std::uniform_int_distribution<size_t>(i, fileNames.size() - 1)(random)]);
+
+        std::vector<std::future<std::pair<size_t, size_t>>> futures; // (files read, matches)
+        for (size_t begin = sampled; begin < end; begin += SAMPLE_BATCH_SIZE) {
+            size_t batchEnd = std::min(begin + SAMPLE_BATCH_SIZE, end);
+            futures.push_back(pool.enqueue([&, begin, batchEnd]() {
+                if (estimateInterrupted) return std::make_pair((size_t)0, (size_t)0);
+                ImageStore batch;
+                processFileBatch(folderPath, fileNames, begin, batchEnd, batch, options.readMode);
+                size_t batchMatches = 0;
+                for (uint32_t id = 0; id < batch.size(); ++id) {
+                    if (batch.mayContain(id, trigramHashes) && imageMatchesAll(batch, id, terms)) ++batchMatches;
+                }
+                return std::make_pair(batchEnd - begin, batchMatches);
+            }));
+        }
+
+        // Batches skipped after an interruption don't bias the sample, the files of a round are in random order
+        size_t roundFiles = 0;
+        for (auto& f : futures) {
+            std::pair<size_t, size_t> result = f.get();
+            roundFiles += result.first;
+            matched += result.second;
+        }
+        sampled += roundFiles;
+
+        estimateInterval(matched, sampled, fileNames.size(), estimate, low, high);
+        console << "Sampled " << sampled << " of " << fileNames.size() << " files, " << matched << " matched: about "
+                << (uint64_t)std::llround(estimate) << " matches (95% confidence " << (uint64_t)std::llround(low) << " to "
+                << (uint64_t)std::llround(high) << ")." << (sampled < fileNames.size() && !estimateInterrupted ? " Press Ctrl+C to stop." : "") << std::endl;
+    }
+    SetConsoleCtrlHandler(interruptEstimate, FALSE);
+
+    std::ostringstream line;
+    line << (uint64_t)std::llround(estimate) << '\t' << (uint64_t)std::llround(low) << '\t' << (uint64_t)std::llround(high)
+         << '\t' << sampled << '\t' << fileNames.size() << '\n';
+    writeResults(line.str(), options);
+}
+
+// Layout of the index file. The header is followed by sections that each start on an 8 byte boundary,
+// so the offset tables are used in place once the file is mapped and nothing is parsed at startup
+const char INDEX_MAGIC[8] = {'P', 'N', 'G', 'M', 'I', 'D', 'X', '\0'};
+const uint32_t INDEX_VERSION = 6;
+const size_t INDEX_RESTART_INTERVAL = 16; // Front coded strings start over from an empty prefix every 16 entries
+const uint32_t POSITION_LINE_GAP = 1024;  // Token positions jump by this much at each line, so no phrase or NEAR spans two
+static_assert(POSITION_LINE_GAP > SearchTerm::MAX_NEAR_DISTANCE, "lines must stay further apart than any NEAR distance");
+
+enum IndexSectionId {
+    TitleRestarts,    // uint64 per 16 titles, offset of the first one in Titles
+    Titles,           // Titles in sorted order, front coded as varint shared prefix, varint suffix length, suffix
+    BlockOffsets,     // uint64 per image plus one, into Blocks
+    RawSizes,         // uint32 per image, size of its block once inflated
+    Blocks,           // Entries of each image packed and deflated like in a compressed store
+    SignatureOffsets, // uint64 per image plus one, in words of Signatures
+    Signatures,       // Trigram signatures of the images
+    TermRestarts,     // uint64 per 16 terms, offset of the first one in Terms
+    Terms,            // Sorted tokens front coded like titles, each followed by its varint document frequency, posting offset and impact bound
+    Postings,         // Per term, varint deltas of the ids of the images holding it, each followed by its varint count there,
+                      // the varint byte size of its positions and the varint deltas of the positions of the term there
+    TrigramTable,     // IndexTrigram per distinct trigram, in increasing order
+    TrigramPostings,  // Per trigram, varint deltas of the ids of the images holding it
+    TokenCounts,      // uint32 per image, number of tokens in its metadata
+    CompletionNodes,  // IndexTrieNode per node of a radix trie over the terms, the root first
+    CompletionLabels, // Edge labels of the trie nodes
+    IndexSectionCount
+};
+
+struct IndexSection {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Entry of the trigram table, trigrams are the three lowercase bytes searches and signatures use
+struct IndexTrigram {
+    uint32_t trigram;
+    uint32_t imageCount;
+    uint64_t postingOffset; // Into TrigramPostings
+};
+
+// Node of the completion trie. Children are consecutive and sorted by the first byte of their label, and each node
+// knows the highest document frequency below it, so the most frequent completions are found without a full walk
+struct IndexTrieNode {
+    uint32_t labelOffset;       // Into CompletionLabels, the bytes leading from the parent to this node
+    uint32_t labelSize;
+    uint32_t firstChild;
+    uint32_t childCount;
+    uint32_t documentFrequency; // Of the term ending at this node, 0 when none does
+    uint32_t bestFrequency;     // Highest document frequency of the terms in this subtree
+};
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t imageCount;
+    uint64_t folderStamp;     // getFolderStamp of the indexed folder, it changes whenever a file comes, goes or changes
+    uint64_t termCount;
+    uint64_t trigramCount;
+    uint64_t tokenCount;      // Tokens in all images, for the average metadata length relevance scores use
+    IndexSection sections[IndexSectionCount];
+};
+
+// BM25 parameters: how quickly repeated terms stop adding to the score, and how much long metadata is discounted
+const double BM25_K1 = 1.2;
+const double BM25_B = 0.75;
+const double IMPACT_SCALE = 65536.0; // Impact bounds are stored as integers in 1/65536 steps, rounded up
+
+// Part of the BM25 score of a term in an image that depends on the image, between 0 and 1:
+// count / (count + k1 * (1 - b + b * length / average length))
+inline double bm25Impact(uint32_t count, uint32_t tokenCount, double averageTokenCount) {
+    return count / (count + BM25_K1 * (1 - BM25_B + BM25_B * tokenCount / averageTokenCount));
+}
+
+// Inverse document frequency of a term held by 'documentFrequency' of 'imageCount' images
+inline double bm25Idf(uint64_t documentFrequency, uint64_t imageCount) {
+    return std::log(1 + (imageCount - documentFrequency + 0.5) / (documentFrequency + 0.5));
+}
+
+// What the dictionary knows of a term
+struct IndexTerm {
+    uint64_t documentFrequency; // Images holding the term
+    const char* postings;       // Its posting list
+    double maxImpact;           // Upper bound of its impact in any image
+};
+
+// Fingerprint of the PNG files of a folder from their names, sizes and last write times, which the listing already
+// holds. Unlike the folder's own write time it also changes when a file is rewritten in place. Per file hashes are
+// summed, so the order of the listing doesn't matter. 0 when the folder can't be listed
+uint64_t getFolderStamp(const std::string& folderPath) {
+    WIN32_FIND_DATAA findFileData;
+    HANDLE hFind = FindFirstFileA((folderPath + "\\*.png").c_str(), &findFileData);
+    if (hFind == INVALID_HANDLE_VALUE) return 0;
+
+    uint64_t stamp = 0;
+    do {
+        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        uint64_t size = ((uint64_t)findFileData.nFileSizeHigh << 32) | findFileData.nFileSizeLow;
+        uint64_t written = ((uint64_t)findFileData.ftLastWriteTime.dwHighDateTime << 32) | findFileData.ftLastWriteTime.dwLowDateTime;
+        uint64_t hash = hashBytes(findFileData.cFileName, strlen(findFileData.cFileName));
+        hash = (hash ^ size) * 0xFF51AFD7ED558CCDull;
+        hash = (hash ^ written) * 0xC4CEB9FE1A85EC53ull;
+        stamp += hash ^ (hash >> 33);
+    } while (FindNextFileA(hFind, &findFileData) != 0);
+
+    FindClose(hFind);
+    return stamp;
+}
+
+// Reads the next front coded string over the previous one held in 'value'
+inline void readFrontCoded(const char*& cursor, const char* end, std::string& value) {
+    size_t shared = (size_t)std::min<uint64_t>(readVarint(cursor, end), value.size());
+    size_t suffixLength = readLength(cursor, end);
+    value.resize(shared);
+    value.append(cursor, suffixLength);
+    cursor += suffixLength;
+}
+
+// Appends 'value' front coded against 'previous', restarting from an empty prefix on every restart entry
+inline void appendFrontCoded(std::string& out, const std::string& previous, const std::string& value, bool restart) {
+    size_t shared = 0;
+    if (!restart) {
+        size_t limit = std::min(previous.size(), value.size());
+        while (shared < limit && previous[shared] == value[shared]) ++shared;
+    }
+    appendVarint(out, shared);
+    appendVarint(out, value.size() - shared);
+    out.append(value, shared, std::string::npos);
+}
+
+// Builds the completion trie of the sorted terms breadth first, so that the children of a node end up consecutive.
+// A node covers the terms sharing its path, and each group of them with the same next byte gets a child labelled up
+// to their longest common prefix
+void buildCompletionTrie(const std::vector<const std::string*>& terms, const std::vector<uint32_t>& frequencies,
+                         std::vector<IndexTrieNode>& nodes, std::string& labels) {
+    struct Pending {
+        uint32_t node;
+        size_t begin, end; // Terms under the node
+        size_t depth;      // Length of its path
+    };
+    nodes.assign(1, IndexTrieNode{0, 0, 0, 0, 0, 0});
+    std::vector<Pending> queue(1, Pending{0, 0, terms.size(), 0});
+    for (size_t q = 0; q < queue.size(); ++q) {
+        Pending item = queue[q];
+        size_t begin = item.begin;
+        if (begin < item.end && terms[begin]->size() == item.depth) nodes[item.node].documentFrequency = frequencies[begin++];
+        nodes[item.node].firstChild = (uint32_t)nodes.size();
+
+        for (size_t groupEnd; begin < item.end; begin = groupEnd) {
+            const std::string& first = *terms[begin];
+            for (groupEnd = begin + 1; groupEnd < item.end && (*terms[groupEnd])[item.depth] == first[item.depth]; ++groupEnd) {}
+            const std::string& last = *terms[groupEnd - 1];
+            size_t depth = item.depth + 1;
+            while (depth < first.size() && depth < last.size() && first[depth] == last[depth]) ++depth;
+
+            nodes.push_back(IndexTrieNode{(uint32_t)labels.size(), (uint32_t)(depth - item.depth), 0, 0, 0, 0});
+            labels.append(first, item.depth, depth - item.depth);
+            ++nodes[item.node].childCount;
+            queue.push_back(Pending{(uint32_t)nodes.size() - 1, begin, groupEnd, depth});
+        }
+    }
+
+    // Children come after their parent, so one backward pass gives every subtree its best frequency
+    for (size_t n = nodes.size(); n-- > 0;) {
+        IndexTrieNode& node = nodes[n];
+        node.bestFrequency = node.documentFrequency;
+        for (uint32_t c = node.firstChild; c < node.firstChild + node.childCount; ++c)
+            node.bestFrequency = std::max(node.bestFrequency, nodes[c].bestFrequency);
+    }
+}
+
+// Function to write the first 'imageCount' images of the store as an index file. Titles are sorted so front coding
+// shares their common prefixes, which also gives the images their ids in the index. The file is written next to its
+// final name and renamed over it, so a reader never maps a half written index
+bool writeIndexFile(const ImageStore& store, size_t imageCount, const std::string& indexFile, uint64_t folderStamp) {
+    std::vector<uint32_t> order(imageCount);
+    for (uint32_t id = 0; id < imageCount; ++id) order[id] = id;
+    std::sort(order.begin(), order.end(), [&store](uint32_t a, uint32_t b) {
+        StrRef titleA = store.title(a), titleB = store.title(b);
+        int result = memcmp(titleA.data, titleB.data, std::min(titleA.size, titleB.size));
+        return result != 0 ? result < 0 : titleA.size < titleB.size;
+    });
+
+    std::vector<uint64_t> titleRestarts, blockOffsets{0}, signatureOffsets{0}, signatureWords;
+    std::vector<uint32_t> rawSizes;
+    std::string titles, blocks, previousTitle, title, packed, token;
+    // Postings are encoded as the images go by, the counts are kept apart for the impact bounds
+    struct TermPostingList {
+        std::vector<std::pair<uint32_t, uint32_t>> images; // (image, count)
+        std::string bytes;
+    };
+    std::unordered_map<std::string, TermPostingList> postings;
+    std::unordered_map<std::string, std::vector<uint32_t>> termPositions;
+    std::string positionBytes;
+    std::vector<uint32_t> tokenCounts;
+    uint64_t totalTokens = 0;
+    ImageReader reader;
+    MetadataCodec codec;
+
+    // Trigram postings are delta coded as the images go by, which keeps them compact while the index is built
+    struct TrigramPostingList {
+        std::string bytes;
+        uint32_t lastId = 0;
+        uint32_t count = 0;
+    };
+    std::unordered_map<uint32_t, TrigramPostingList> trigramPostings;
+    TrigramSignatureBuilder trigramCollector;
+
+    for (uint32_t newId = 0; newId < imageCount; ++newId) {
+        uint32_t id = order[newId];
+        bool restart = newId % INDEX_RESTART_INTERVAL == 0;
+        if (restart) titleRestarts.push_back(titles.size());
+        title = store.title(id).str();
+        appendFrontCoded(titles, previousTitle, title, restart);
+        previousTitle.swap(title);
+
+        // Blocks of a compressed store are copied as they are, otherwise the entries get packed here
+        size_t viewId;
+        const ImageStore& image = reader.open(store, id, viewId);
+        if (store.compressed) {
+            blocks.append(store.blocks, store.blockOffsets[id], store.blockOffsets[id + 1] - store.blockOffsets[id]);
+            rawSizes.push_back(store.rawSizes[id]);
+        } else {
+            packed.clear();
+            for (uint32_t e = image.entryBegin(viewId); e < image.entryEnd(viewId); ++e)
+                ImageStore::packEntry(packed, image.keyword(e), image.value(e));
+            codec.compress(packed, blocks);
+            rawSizes.push_back((uint32_t)packed.size());
+        }
+        blockOffsets.push_back(blocks.size());
+
+        if (id + 1 < store.signatureOffsets.size())
+            signatureWords.insert(signatureWords.end(), store.signatureWords.begin() + store.signatureOffsets[id],
+                                  store.signatureWords.begin() + store.signatureOffsets[id + 1]);
+        signatureOffsets.push_back(signatureWords.size());
+
+        // Keywords and value lines are tokenized apart, a token never spans a separator anyway. Positions run on
+        // from a keyword into the first line of its value, like the text searches look at
+        termPositions.clear();
+        uint32_t position = 0;
+        auto addToken = [&termPositions, &position](StrRef term, size_t) { termPositions[term.str()].push_back(position++); };
+        for (uint32_t e = image.entryBegin(viewId); e < image.entryEnd(viewId); ++e) {
+            StrRef keyword = image.keyword(e);
+            position += POSITION_LINE_GAP;
+            forEachToken(keyword.data, keyword.size, token, addToken);
+            for (uint32_t l = image.lineBegin(e); l < image.lineEnd(e); ++l) {
+                if (l != image.lineBegin(e)) position += POSITION_LINE_GAP;
+                StrRef line = image.line(l);
+                forEachToken(line.data, line.size, token, addToken);
+            }
+        }
+        uint32_t imageTokens = 0;
+        for (const auto& pair : termPositions) {
+            TermPostingList& list = postings[pair.first];
+            positionBytes.clear();
+            uint32_t previousPosition = 0;
+            for (uint32_t termPosition : pair.second) {
+                appendVarint(positionBytes, termPosition - previousPosition);
+                previousPosition = termPosition;
+            }
+            appendVarint(list.bytes, newId - (list.images.empty() ? 0 : list.images.back().first));
+            appendVarint(list.bytes, pair.second.size());
+            appendVarint(list.bytes, positionBytes.size());
+            list.bytes += positionBytes;
+            list.images.emplace_back(newId, (uint32_t)pair.second.size());
+            imageTokens += (uint32_t)pair.second.size();
+        }
+        tokenCounts.push_back(imageTokens);
+        totalTokens += imageTokens;
+
+        // Trigrams are collected over "keyword: value" per entry, the text searches look at
+        trigramCollector.reset();
+        for (uint32_t e = image.entryBegin(viewId); e < image.entryEnd(viewId); ++e) {
+            StrRef keyword = image.keyword(e);
+            trigramCollector.breakText();
+            trigramCollector.feed(keyword.data, keyword.size);
+            trigramCollector.feed(": ", 2);
+            for (uint32_t l = image.lineBegin(e); l < image.lineEnd(e); ++l) {
+                StrRef line = image.line(l);
+                trigramCollector.feed(line.data, line.size);
+                trigramCollector.breakText();
+            }
+        }
+        for (uint32_t trigram : trigramCollector.distinctTrigrams()) {
+            TrigramPostingList& list = trigramPostings[trigram];
+            appendVarint(list.bytes, newId - list.lastId);
+            list.lastId = newId;
+            ++list.count;
+        }
+    }
+
+    // Term dictionary in sorted order, each term pointing at its postings
+    std::vector<const std::string*> sortedTerms;
+    sortedTerms.reserve(postings.size());
+    for (const auto& pair : postings) sortedTerms.push_back(&pair.first);
+    std::sort(sortedTerms.begin(), sortedTerms.end(), [](const std::string* a, const std::string* b) { return *a < *b; });
+
+    // Each term also gets the highest impact it has in any image, what ranked queries bound their scores with
+    const double averageTokenCount = imageCount ? std::max(1.0, (double)totalTokens / imageCount) : 1.0;
+    std::vector<uint64_t> termRestarts;
+    std::vector<uint32_t> documentFrequencies;
+    std::string terms, postingBytes, previousTerm;
+    for (size_t t = 0; t < sortedTerms.size(); ++t) {
+        const std::string& term = *sortedTerms[t];
+        const TermPostingList& list = postings[term];
+        documentFrequencies.push_back((uint32_t)list.images.size());
+        double maxImpact = 0;
+        for (const auto& posting : list.images) maxImpact = std::max(maxImpact, bm25Impact(posting.second, tokenCounts[posting.first], averageTokenCount));
+
+        bool restart = t % INDEX_RESTART_INTERVAL == 0;
+        if (restart) termRestarts.push_back(terms.size());
+        appendFrontCoded(terms, previousTerm, term, restart);
+        appendVarint(terms, list.images.size());
+        appendVarint(terms, postingBytes.size());
+        appendVarint(terms, (uint64_t)std::ceil(maxImpact * IMPACT_SCALE));
+        previousTerm = term;
+        postingBytes += list.bytes;
+    }
+
+    std::vector<IndexTrieNode> trieNodes;
+    std::string trieLabels;
+    buildCompletionTrie(sortedTerms, documentFrequencies, trieNodes, trieLabels);
+
+    std::vector<IndexTrigram> trigramTable;
+    trigramTable.reserve(trigramPostings.size());
+    for (const auto& pair : trigramPostings) trigramTable.push_back(IndexTrigram{pair.first, pair.second.count, 0});
+    std::sort(trigramTable.begin(), trigramTable.end(), [](const IndexTrigram& a, const IndexTrigram& b) { return a.trigram < b.trigram; });
+    std::string trigramPostingBytes;
+    for (IndexTrigram& entry : trigramTable) {
+        entry.postingOffset = trigramPostingBytes.size();
+        trigramPostingBytes += trigramPostings[entry.trigram].bytes;
+    }
+
+    // Lay the sections out after the header
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.imageCount = (uint32_t)imageCount;
+    header.folderStamp = folderStamp;
+    header.termCount = sortedTerms.size();
+    header.trigramCount = trigramTable.size();
+    header.tokenCount = totalTokens;
+
+    const StrRef sections[IndexSectionCount] = {
+        StrRef((const char*)titleRestarts.data(), titleRestarts.size() * sizeof(uint64_t)),
+        StrRef(titles),
+        StrRef((const char*)blockOffsets.data(), blockOffsets.size() * sizeof(uint64_t)),
+        StrRef((const char*)rawSizes.data(), rawSizes.size() * sizeof(uint32_t)),
+        StrRef(blocks),
+        StrRef((const char*)signatureOffsets.data(), signatureOffsets.size() * sizeof(uint64_t)),
+        StrRef((const char*)signatureWords.data(), signatureWords.size() * sizeof(uint64_t)),
+        StrRef((const char*)termRestarts.data(), termRestarts.size() * sizeof(uint64_t)),
+        StrRef(terms),
+        StrRef(postingBytes),
+        StrRef((const char*)trigramTable.data(), trigramTable.size() * sizeof(IndexTrigram)),
+        StrRef(trigramPostingBytes),
+        StrRef((const char*)tokenCounts.data(), tokenCounts.size() * sizeof(uint32_t)),
+        StrRef((const char*)trieNodes.data(), trieNodes.size() * sizeof(IndexTrieNode)),
+        StrRef(trieLabels),
+    };
+    uint64_t offset = sizeof(header);
+    for (int s = 0; s < IndexSectionCount; ++s) {
+        header.sections[s].offset = offset;
+        header.sections[s].size = sections[s].size;
+        offset = (offset + sections[s].size + 7) & ~(uint64_t)7;
+    }
+
+    std::string tempFile = indexFile + ".tmp";
+    FILE* out = fopen(tempFile.c_str(), "wb");
+    if (!out) {
+        std::cerr << "Failed to create index file " << indexFile << std::endl;
+        return false;
+    }
+    static const char padding[8] = {0};
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (int s = 0; s < IndexSectionCount && written; ++s) {
+        if (sections[s].size) written = fwrite(sections[s].data, 1, sections[s].size, out) == sections[s].size;
+        size_t pad = (size_t)((8 - (header.sections[s].offset + sections[s].size) % 8) % 8);
+        if (pad && written) written = fwrite(padding, 1, pad, out) == pad;
+    }
+    written = fclose(out) == 0 && written;
+
+    if (!written || !MoveFileExA(tempFile.c_str(), indexFile.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        std::cerr << "Failed to write index file " << indexFile << ". Error: " << GetLastError() << std::endl;
+        DeleteFileA(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Walks a posting list of the term dictionary one image at a time
+struct PostingCursor {
+    const char* cursor;
+    const char* end;
+    uint64_t remaining; // Postings not read yet
+    uint32_t id = 0;    // Current image
+    uint32_t count = 0; // Occurrences of the term in it
+    bool done = false;  // Set once the list is exhausted
+    const char* positions = nullptr; // Encoded positions of the term in the current image
+    size_t positionBytes = 0;
+
+    PostingCursor(const char* cursor, const char* end, uint64_t remaining) : cursor(cursor), end(end), remaining(remaining) {}
+
+    // Moves to the next image, false once the list is exhausted
+    bool next() {
+        if (remaining == 0 || cursor >= end) {
+            done = true;
+            return false;
+        }
+        --remaining;
+        id += (uint32_t)readVarint(cursor, end);
+        count = (uint32_t)readVarint(cursor, end);
+        positionBytes = readLength(cursor, end);
+        positions = cursor;
+        cursor += positionBytes; // Positions are only decoded for the images a phrase needs them in
+        return true;
+    }
+
+    // Decodes the positions of the term in the current image, in increasing order
+    void readPositions(std::vector<uint32_t>& out) const {
+        out.clear();
+        const char* position = positions;
+        uint32_t value = 0;
+        while (position < positions + positionBytes) {
+            value += (uint32_t)readVarint(position, positions + positionBytes);
+            out.push_back(value);
+        }
+    }
+
+    // Moves to the first image at or after 'target', false if there is none
+    bool advanceTo(uint32_t target) {
+        while (id < target) {
+            if (!next()) return false;
+        }
+        return !done;
+    }
+};
+
+// Read-only view of an index file mapped in memory. Opening it only checks the header, every lookup
+// reads the mapped sections in place and the OS page cache keeps the parts in use
+class MappedIndex {
+private:
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    const char* base = nullptr;
+    const IndexHeader* header = nullptr;
+
+    const char* sectionData(IndexSectionId id) const { return base + header->sections[id].offset; }
+    const char* sectionEnd(IndexSectionId id) const { return sectionData(id) + header->sections[id].size; }
+    template<class T> const T* table(IndexSectionId id) const { return (const T*)sectionData(id); }
+
+    void close() {
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+        base = nullptr;
+        header = nullptr;
+    }
+
+    // Checks that every section lies inside the file and that the tables have the sizes the counts call for, which
+    // only reads the header. The offsets the tables hold are checked where they are read, so a damaged file yields
+    // empty images and lists instead of reads past its end
+    bool validate(uint64_t fileSize) const {
+        if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION) return false;
+        for (int s = 0; s < IndexSectionCount; ++s) {
+            const IndexSection& section = header->sections[s];
+            if (section.offset % 8 != 0 || section.offset > fileSize || section.size > fileSize - section.offset) return false;
+        }
+        uint64_t images = header->imageCount;
+        uint64_t titleBlocks = (images + INDEX_RESTART_INTERVAL - 1) / INDEX_RESTART_INTERVAL;
+        uint64_t termBlocks = (header->termCount + INDEX_RESTART_INTERVAL - 1) / INDEX_RESTART_INTERVAL;
+        if (header->sections[TitleRestarts].size != titleBlocks * sizeof(uint64_t)) return false;
+        if (header->sections[BlockOffsets].size != (images + 1) * sizeof(uint64_t)) return false;
+        if (header->sections[RawSizes].size != images * sizeof(uint32_t)) return false;
+        if (header->sections[SignatureOffsets].size != (images + 1) * sizeof(uint64_t)) return false;
+        if (header->sections[TermRestarts].size != termBlocks * sizeof(uint64_t)) return false;
+        if (header->sections[TrigramTable].size != header->trigramCount * sizeof(IndexTrigram)) return false;
+        if (header->sections[TokenCounts].size != images * sizeof(uint32_t)) return false;
+        if (header->sections[CompletionNodes].size == 0 || header->sections[CompletionNodes].size % sizeof(IndexTrieNode) != 0) return false;
+        return true;
+    }
+
+    // Start of entry 'i' of a restart table inside its section, the section end when the stored offset is past it
+    const char* restartPoint(IndexSectionId tableId, IndexSectionId dataId, size_t i) const {
+        return sectionData(dataId) + std::min<uint64_t>(table<uint64_t>(tableId)[i], header->sections[dataId].size);
+    }
+
+    // Range [begin, end) of image 'id' in a table of offsets into a section of 'unit' sized items, false when the
+    // id or the offsets are out of bounds
+    bool rangeOf(IndexSectionId tableId, IndexSectionId dataId, uint64_t unit, size_t id, uint64_t& begin, uint64_t& end) const {
+        if (id >= header->imageCount) return false;
+        const uint64_t* offsets = table<uint64_t>(tableId);
+        begin = offsets[id];
+        end = offsets[id + 1];
+        return begin <= end && end <= header->sections[dataId].size / unit;
+    }
+
+    // First term of a block of the dictionary, which is stored whole
+    StrRef restartTerm(size_t block, const char*& cursor) const {
+        cursor = restartPoint(TermRestarts, Terms, block);
+        const char* end = sectionEnd(Terms);
+        readVarint(cursor, end);
+        size_t length = readLength(cursor, end);
+        StrRef term(cursor, length);
+        cursor += length;
+        return term;
+    }
+
+    const IndexTrigram* findTrigram(uint32_t trigram) const {
+        const IndexTrigram* begin = table<IndexTrigram>(TrigramTable);
+        const IndexTrigram* end = begin + header->trigramCount;
+        const IndexTrigram* entry = std::lower_bound(begin, end, trigram,
+            [](const IndexTrigram& item, uint32_t value) { return item.trigram < value; });
+        return entry != end && entry->trigram == trigram ? entry : nullptr;
+    }
+
+public:
+    MappedIndex() {}
+    MappedIndex(const MappedIndex&) = delete;
+    MappedIndex& operator=(const MappedIndex&) = delete;
+    ~MappedIndex() { close(); }
+
+    // Maps the index file, false when it is missing, damaged or describes another state of the folder
+    bool open(const std::string& indexFile, uint64_t folderStamp) {
+        close();
+        file = CreateFileA(indexFile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || (uint64_t)fileSize.QuadPart < sizeof(IndexHeader)) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) base = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!base) {
+            close();
+            return false;
+        }
+
+        header = (const IndexHeader*)base;
+        if (!validate((uint64_t)fileSize.QuadPart) || header->folderStamp != folderStamp) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    size_t size() const { return header ? header->imageCount : 0; }
+
+    // Decodes the title of an image into 'scratch', walking at most 15 titles from the last restart point
+    StrRef title(size_t id, std::string& scratch) const {
+        scratch.clear();
+        if (id >= header->imageCount) return StrRef(scratch);
+        const char* cursor = restartPoint(TitleRestarts, Titles, id / INDEX_RESTART_INTERVAL);
+        const char* end = sectionEnd(Titles);
+        for (size_t i = 0; i <= id % INDEX_RESTART_INTERVAL; ++i) readFrontCoded(cursor, end, scratch);
+        return StrRef(scratch);
+    }
+
+    StrRef block(size_t id) const {
+        uint64_t begin, end;
+        if (!rangeOf(BlockOffsets, Blocks, 1, id, begin, end)) return StrRef(sectionData(Blocks), 0);
+        return StrRef(sectionData(Blocks) + begin, end - begin);
+    }
+
+    // Size of the entries of an image once inflated, 0 when a damaged file claims more than deflate ever packs
+    // into the size of its block
+    uint32_t rawSize(size_t id) const {
+        const uint64_t MAX_DEFLATE_RATIO = 1032;
+        if (id >= header->imageCount) return 0;
+        uint32_t size = table<uint32_t>(RawSizes)[id];
+        return size <= (block(id).size + 1) * MAX_DEFLATE_RATIO ? size : 0;
+    }
+
+    const uint64_t* signature(size_t id, size_t& wordCount) const {
+        uint64_t begin, end;
+        if (!rangeOf(SignatureOffsets, Signatures, sizeof(uint64_t), id, begin, end)) begin = end = 0;
+        wordCount = (size_t)(end - begin);
+        return table<uint64_t>(Signatures) + begin;
+    }
+
+    bool mayContain(size_t id, const std::vector<uint64_t>& trigramHashes) const {
+        size_t wordCount;
+        const uint64_t* words = signature(id, wordCount);
+        return wordCount == 0 || TrigramSignatureBuilder::mayContain(words, wordCount, trigramHashes);
+    }
+
+    // Looks a lowercase token up in the term dictionary, binary searching the restart points then walking one block
+    bool findTerm(StrRef term, IndexTerm& found) const {
+        size_t blocks = header->sections[TermRestarts].size / sizeof(uint64_t);
+        const std::string wanted = term.str();
+        const char* cursor;
+        size_t low = 0, high = blocks;
+        while (high - low > 1) {
+            size_t middle = (low + high) / 2;
+            if (restartTerm(middle, cursor).str() <= wanted) low = middle;
+            else high = middle;
+        }
+        if (blocks == 0) return false;
+
+        cursor = restartPoint(TermRestarts, Terms, low);
+        const char* end = sectionEnd(Terms);
+        std::string current;
+        for (size_t i = 0; i < INDEX_RESTART_INTERVAL && cursor < end; ++i) {
+            readFrontCoded(cursor, end, current);
+            found.documentFrequency = readVarint(cursor, end);
+            uint64_t postingOffset = readVarint(cursor, end);
+            found.maxImpact = readVarint(cursor, end) / IMPACT_SCALE;
+            if (current == wanted) {
+                found.postings = sectionData(Postings) + std::min<uint64_t>(postingOffset, header->sections[Postings].size);
+                return true;
+            }
+            if (current > wanted) break;
+        }
+        return false;
+    }
+
+    // Ids of the images holding a lowercase token, in increasing order
+    std::vector<uint32_t> imagesWithTerm(StrRef term) const {
+        std::vector<uint32_t> ids;
+        IndexTerm found;
+        if (!findTerm(term, found)) return ids;
+
+        ids.reserve((size_t)found.documentFrequency);
+        for (PostingCursor cursor = postingsOf(found); cursor.next();) ids.push_back(cursor.id);
+        return ids;
+    }
+
+    // Up to 'count' terms starting with the lowercase 'prefix' with the number of images holding them, the most
+    // frequent first. The trie is walked down to the prefix, then its subtree is explored best first: a node is
+    // only opened once no term outside it can beat the best one it holds
+    std::vector<std::pair<std::string, uint32_t>> complete(StrRef prefix, size_t count) const {
+        std::vector<std::pair<std::string, uint32_t>> completions;
+        const IndexTrieNode* nodes = table<IndexTrieNode>(CompletionNodes);
+        const uint64_t nodeCount = header->sections[CompletionNodes].size / sizeof(IndexTrieNode);
+        const char* labels = sectionData(CompletionLabels);
+        const uint64_t labelBytes = header->sections[CompletionLabels].size;
+        auto isValid = [&](uint32_t id) {
+            return id < nodeCount && (uint64_t)nodes[id].labelOffset + nodes[id].labelSize <= labelBytes &&
+                   (uint64_t)nodes[id].firstChild + nodes[id].childCount <= nodeCount;
+        };
+
+        uint32_t node = 0;
+        std::string path;
+        for (size_t matched = 0; matched < prefix.size;) {
+            if (!isValid(node)) return completions;
+            uint32_t next = UINT32_MAX;
+            for (uint32_t c = nodes[node].firstChild; c < nodes[node].firstChild + nodes[node].childCount; ++c) {
+                if (isValid(c) && nodes[c].labelSize > 0 && labels[nodes[c].labelOffset] == prefix.data[matched]) {
+                    next = c;
+                    break;
+                }
+            }
+            if (next == UINT32_MAX) return completions;
+
+            const char* label = labels + nodes[next].labelOffset;
+            size_t common = std::min<size_t>(nodes[next].labelSize, prefix.size - matched);
+            if (memcmp(label, prefix.data + matched, common) != 0) return completions;
+            path.append(label, nodes[next].labelSize);
+            matched += common;
+            node = next;
+        }
+        if (!isValid(node)) return completions;
+
+        // Queue entries are subtrees to open, or the term of a node once 'isTerm' is set
+        struct Candidate {
+            uint32_t frequency;
+            bool isTerm;
+            uint32_t node;
+            std::string text;
+
+            bool operator<(const Candidate& other) const {
+                if (frequency != other.frequency) return frequency < other.frequency;
+                if (isTerm != other.isTerm) return !isTerm;
+                return text > other.text;
+            }
+        };
+        std::priority_queue<Candidate> queue;
+        queue.push(Candidate{nodes[node].bestFrequency, false, node, path});
+        while (!queue.empty() && completions.size() < count) {
+            Candidate candidate = queue.top();
+            queue.pop();
+            if (candidate.isTerm) {
+                completions.emplace_back(candidate.text, candidate.frequency);
+                continue;
+            }
+            const IndexTrieNode& current = nodes[candidate.node];
+            if (current.documentFrequency > 0) queue.push(Candidate{current.documentFrequency, true, candidate.node, candidate.text});
+            for (uint32_t c = current.firstChild; c < current.firstChild + current.childCount; ++c) {
+                if (isValid(c) && nodes[c].bestFrequency > 0)
+                    queue.push(Candidate{nodes[c].bestFrequency, false, c, candidate.text + std::string(labels + nodes[c].labelOffset, nodes[c].labelSize)});
+            }
+        }
+        return completions;
+    }
+
+    // Calls onTerm(term) for every term of the dictionary, in order
+    template<class OnTerm>
+    void forEachTerm(OnTerm onTerm) const {
+        const char* cursor = sectionData(Terms);
+        const char* end = sectionEnd(Terms);
+        std::string current;
+        for (uint64_t t = 0; t < header->termCount && cursor < end; ++t) {
+            if (t % INDEX_RESTART_INTERVAL == 0) current.clear();
+            readFrontCoded(cursor, end, current);
+            readVarint(cursor, end); // Document frequency
+            readVarint(cursor, end); // Posting offset
+            readVarint(cursor, end); // Impact bound
+            onTerm(current);
+        }
+    }
+
+    // Cursor over the posting list of a term found in the dictionary
+    PostingCursor postingsOf(const IndexTerm& term) const {
+        return PostingCursor(term.postings, sectionEnd(Postings), term.documentFrequency);
+    }
+
+    uint32_t tokenCount(size_t id) const { return id < header->imageCount ? table<uint32_t>(TokenCounts)[id] : 0; }
+    double averageTokenCount() const { return header->imageCount ? std::max(1.0, (double)header->tokenCount / header->imageCount) : 1.0; }
+
+    // Number of images holding a trigram, 0 when none does
+    uint32_t trigramImageCount(uint32_t trigram) const {
+        const IndexTrigram* entry = findTrigram(trigram);
+        return entry ? entry->imageCount : 0;
+    }
+
+    // Ids of the images holding a trigram, in increasing order
+    std::vector<uint32_t> imagesWithTrigram(uint32_t trigram) const {
+        std::vector<uint32_t> ids;
+        const IndexTrigram* entry = findTrigram(trigram);
+        if (!entry) return ids;
+
+        const char* cursor = sectionData(TrigramPostings) + std::min<uint64_t>(entry->postingOffset, header->sections[TrigramPostings].size);
+        const char* end = sectionEnd(TrigramPostings);
+        ids.reserve((size_t)std::min<uint64_t>(entry->imageCount, header->imageCount));
+        uint64_t id = 0;
+        for (uint32_t i = 0; i < entry->imageCount && cursor < end; ++i) {
+            id += readVarint(cursor, end);
+            if (id >= header->imageCount) break;
+            ids.push_back((uint32_t)id);
+        }
+        return ids;
+    }
+};
+
+// Tokens of a lowercase search term that have a separator on both sides inside the term. An image holding the term
+// holds each of them as a whole token, so their postings narrow the candidates even though terms are substrings
+std::vector<std::string> boundedTokens(const std::string& lowerTerm) {
+    std::vector<std::string> tokens;
+    std::string token;
+    forEachToken(lowerTerm.data(), lowerTerm.size(), token, [&](StrRef value, size_t start) {
+        if (start > 0 && start + value.size < lowerTerm.size()) tokens.push_back(value.str());
+    });
+    return tokens;
+}
+
+// Function to copy images from the index into the store, the ones among 'candidates' (every image when null) whose
+// signature may hold all 'trigramHashes' and that 'keep(image, viewId)' accepts once decompressed. Batches run on
+// the pool and fill stores of their own, like a folder scan. With 'maxMatches', batches are smaller and the
+// loading stops once the batches finished without a gap from the first one hold that many images, so the store
+// starts with the first 'maxMatches' images kept in id order, followed by at most a few more
+template<class Keep>
+void loadIndexImages(const MappedIndex& index, const std::vector<uint32_t>* candidates, const std::vector<uint64_t>& trigramHashes,
+                     ImageStore& store, ThreadPool& pool, Keep keep, size_t maxMatches = 0) {
+    const size_t INDEX_BATCH_SIZE = maxMatches > 0 ? 256 : 4096;
+    size_t count = candidates ? candidates->size() : index.size();
+    size_t batchCount = (count + INDEX_BATCH_SIZE - 1) / INDEX_BATCH_SIZE;
+    StopToken stop;
+    std::mutex prefixMutex;
+    std::vector<size_t> batchKept(batchCount, SIZE_MAX); // Images kept by each finished batch, guarded by prefixMutex
+    size_t prefixBatches = 0, prefixKept = 0;
+
+    std::vector<std::future<ImageStore>> futures;
+    for (size_t begin = 0; begin < count; begin += INDEX_BATCH_SIZE) {
+        size_t end = std::min(begin + INDEX_BATCH_SIZE, count);
+        futures.push_back(pool.enqueue([&, begin, end]() {
+            ImageStore batch;
+            ImageReader reader;
+            std::string title;
+            for (size_t i = begin; i < end && !stop.stopRequested(); ++i) {
+                size_t id = candidates ? (*candidates)[i] : i;
+                if (!index.mayContain(id, trigramHashes)) continue;
+
+                const ImageStore& image = reader.decode(index.title(id, title), index.block(id), index.rawSize(id));
+                if (!keep(image, (size_t)0)) continue;
+
+                batch.addImage(image.title(0));
+                for (uint32_t e = image.entryBegin(0); e < image.entryEnd(0); ++e) batch.addEntry(image.keyword(e), image.value(e));
+                size_t wordCount;
+                const uint64_t* words = index.signature(id, wordCount);
+                batch.addSignatureWords(words, wordCount);
+                if (maxMatches > 0 && batch.size() >= maxMatches) break; // The rest of the batch comes after enough
+            }
+            if (maxMatches > 0 && !stop.stopRequested()) {
+                std::lock_guard<std::mutex> lock(prefixMutex);
+                batchKept[begin / INDEX_BATCH_SIZE] = batch.size();
+                while (prefixBatches < batchCount && batchKept[prefixBatches] != SIZE_MAX) prefixKept += batchKept[prefixBatches++];
+                if (prefixKept >= maxMatches) {
+                    stop.requestStop();
+                    pool.cancelPending();
+                }
+            }
+            return batch;
+        }));
+    }
+
+    // Batches dropped once enough images were kept have no store to give back
+    for (auto& f : futures) {
+        try {
+            store.append(f.get());
+        } catch (const std::future_error&) {
+        }
+    }
+}
+
+// Keeps the ids present in both sorted lists, in 'candidates'
+void intersectCandidates(std::vector<uint32_t>& candidates, const std::vector<uint32_t>& ids) {
+    std::vector<uint32_t> both;
+    std::set_intersection(candidates.begin(), candidates.end(), ids.begin(), ids.end(), std::back_inserter(both));
+    candidates.swap(both);
+}
+
+// Images that may hold a fuzzy term. An occurrence with N edits keeps all but at most 3N of the term's distinct
+// trigrams, since an edit touches at most three trigram positions, so an image must hold at least the rest of them.
+// Returns false when that bound is too weak to rule anything out
+bool fuzzyCandidates(const MappedIndex& index, const SearchTerm& term, std::vector<uint32_t>& candidates) {
+    std::vector<uint32_t> trigrams = termTrigrams(term.text);
+    int needed = (int)trigrams.size() - 3 * term.maxEdits;
+    if (needed <= 0) return false;
+
+    std::vector<uint32_t> ids;
+    for (uint32_t trigram : trigrams) {
+        std::vector<uint32_t> holders = index.imagesWithTrigram(trigram);
+        ids.insert(ids.end(), holders.begin(), holders.end());
+    }
+    std::sort(ids.begin(), ids.end());
+    candidates.clear();
+    for (size_t i = 0, j; i < ids.size(); i = j) {
+        for (j = i; j < ids.size() && ids[j] == ids[i]; ++j) {}
+        if ((int)(j - i) >= needed) candidates.push_back(ids[i]);
+    }
+    return true;
+}
+
+// Images where a phrase term holds, answered from the postings alone: the lists of its words are intersected by
+// leapfrogging, and where all of them meet their positions are decoded and checked like the text of a line would be
+std::vector<uint32_t> phraseCandidates(const MappedIndex& index, const SearchTerm& term) {
+    std::vector<uint32_t> ids;
+    std::vector<PostingCursor> cursors;
+    for (const auto& token : term.tokens) {
+        IndexTerm found;
+        if (!index.findTerm(token, found)) return ids;
+        cursors.push_back(index.postingsOf(found));
+        if (!cursors.back().next()) return ids;
+    }
+
+    std::vector<std::vector<uint32_t>> positions(cursors.size());
+    uint32_t target = 0;
+    while (true) {
+        bool aligned = true;
+        for (auto& cursor : cursors) {
+            if (!cursor.advanceTo(target)) return ids;
+            if (cursor.id != target) {
+                target = cursor.id;
+                aligned = false;
+            }
+        }
+        if (!aligned) continue;
+
+        for (size_t t = 0; t < cursors.size(); ++t) cursors[t].readPositions(positions[t]);
+        if (term.matchesPositions(positions)) ids.push_back(target);
+        ++target;
+    }
+}
+
+// Function to pick the indexed images that may match every search term, returns false when the terms rule none out.
+// Phrases come first, their positional merge finds exactly the images holding them. Candidates are then narrowed to
+// the images holding every trigram of the exact terms and of the literals regular expressions require, from the
+// rarest trigram up, the bounded tokens of those narrow them further and fuzzy terms add a trigram count filter
+bool selectIndexCandidates(const MappedIndex& index, const std::vector<SearchTerm>& query, std::vector<uint32_t>& candidates) {
+    std::vector<uint32_t> trigrams;
+    std::vector<std::string> tokens;
+    for (const auto& term : query) {
+        for (const auto& substring : term.requiredSubstrings()) {
+            std::vector<uint32_t> termTrigramList = termTrigrams(substring);
+            trigrams.insert(trigrams.end(), termTrigramList.begin(), termTrigramList.end());
+            std::vector<std::string> termTokens = boundedTokens(substring);
+            tokens.insert(tokens.end(), termTokens.begin(), termTokens.end());
+        }
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+    // Rarest trigrams first, and once few candidates are left the exact check is cheaper than more postings
+    const size_t FEW_CANDIDATES = 32;
+    std::vector<std::pair<uint32_t, uint32_t>> byCount; // (images holding it, trigram)
+    for (uint32_t trigram : trigrams) {
+        uint32_t count = index.trigramImageCount(trigram);
+        if (count == 0) { // No image holds this trigram, so none can match
+            candidates.clear();
+            return true;
+        }
+        byCount.emplace_back(count, trigram);
+    }
+    std::sort(byCount.begin(), byCount.end());
+
+    candidates.clear();
+    bool narrowed = false;
+    for (const auto& term : query) {
+        if (term.kind != SearchTerm::Phrase) continue;
+        std::vector<uint32_t> ids = phraseCandidates(index, term);
+        if (narrowed) intersectCandidates(candidates, ids);
+        else candidates.swap(ids);
+        narrowed = true;
+    }
+    for (const auto& pair : byCount) {
+        if (narrowed && candidates.size() <= FEW_CANDIDATES) break;
+        std::vector<uint32_t> ids = index.imagesWithTrigram(pair.second);
+        if (narrowed) intersectCandidates(candidates, ids);
+        else candidates.swap(ids);
+        narrowed = true;
+    }
+    for (const auto& token : tokens) {
+        if (narrowed && candidates.size() <= FEW_CANDIDATES) break;
+        std::vector<uint32_t> ids = index.imagesWithTerm(token);
+        if (narrowed) intersectCandidates(candidates, ids);
+        else candidates.swap(ids);
+        narrowed = true;
+    }
+    for (const auto& term : query) {
+        std::vector<uint32_t> ids;
+        if (term.kind != SearchTerm::Fuzzy || (narrowed && candidates.size() <= FEW_CANDIDATES) || !fuzzyCandidates(index, term, ids)) continue;
+        if (narrowed) intersectCandidates(candidates, ids);
+        else candidates.swap(ids);
+        narrowed = true;
+    }
+    return narrowed;
+}
+
+// Function to copy the indexed images that match every search term into the store. Each candidate is checked
+// exactly, so substring semantics are kept. With 'maxMatches', loading stops once the first that many are found
+void loadIndexMatches(const MappedIndex& index, const std::vector<std::string>& wordsToSearch, ImageStore& store, ThreadPool& pool,
+                      size_t maxMatches = 0) {
+    std::vector<SearchTerm> query = parseSearchTerms(wordsToSearch);
+    std::vector<uint32_t> candidates;
+    bool narrowed = selectIndexCandidates(index, query, candidates);
+    loadIndexImages(index, narrowed ? &candidates : nullptr, std::vector<uint64_t>(), store, pool,
+        [&query](const ImageStore& image, size_t viewId) { return imageMatchesAll(image, viewId, query); }, maxMatches);
+}
+
+// Function to count the indexed images matching every search term, candidates are decompressed and checked in
+// place and none is copied out of the index
+size_t countIndexMatches(const MappedIndex& index, const std::vector<std::string>& wordsToSearch, ThreadPool& pool, bool stopAtFirst) {
+    std::vector<SearchTerm> query = parseSearchTerms(wordsToSearch);
+    std::vector<uint32_t> candidates;
+    bool narrowed = selectIndexCandidates(index, query, candidates);
+    return countInBatches(narrowed ? candidates.size() : index.size(), pool, stopAtFirst, [&](size_t i, ImageReader& reader, std::string& title) {
+        uint32_t id = narrowed ? candidates[i] : (uint32_t)i;
+        return imageMatchesAll(reader.decode(index.title(id, title), index.block(id), index.rawSize(id)), 0, query);
+    });
+}
+
+// Function to rank the indexed images matching every search term by BM25 over the tokens of the terms, and return
+// the ids of the best 'topCount' of them, best first. Phrases are scored through their words, regular expressions
+// through the tokens of the literals they require and fuzzy terms through the dictionary terms within their number
+// of edits of their tokens. Posting lists are merged image by image with the MaxScore strategy: once the heap of
+// the best images is full, the terms whose summed score bounds can't lift an image above the weakest of them no
+// longer bring in images of their own, they only top up images the other terms found.
+// Only images that could enter the heap are decompressed and checked against the terms. Matches no posting list
+// holds, such as those of substrings inside words, score 0 and fill the places left after the scored ones
+std::vector<uint32_t> rankIndexMatches(const MappedIndex& index, const std::vector<std::string>& wordsToSearch, size_t topCount) {
+    std::vector<SearchTerm> query = parseSearchTerms(wordsToSearch);
+    std::vector<std::string> tokens;
+    std::vector<std::pair<FuzzyMatcher, int>> fuzzyTokens; // Matcher of a token of a fuzzy term, edits allowed
+    std::vector<size_t> fuzzyLengths;
+    std::string token;
+    for (const auto& term : query) {
+        if (term.kind == SearchTerm::Regex || term.kind == SearchTerm::Phrase) {
+            for (const auto& literal : term.requiredSubstrings())
+                forEachToken(literal.data(), literal.size(), token, [&](StrRef value, size_t) { tokens.push_back(value.str()); });
+            continue;
+        }
+        forEachToken(term.text.data(), term.text.size(), token, [&](StrRef value, size_t) {
+            if (term.isExact()) {
+                tokens.push_back(value.str());
+            } else if ((int)value.size > term.maxEdits) {
+                fuzzyTokens.emplace_back(FuzzyMatcher(value.str()), term.maxEdits);
+                fuzzyLengths.push_back(value.size);
+            }
+        });
+    }
+    if (!fuzzyTokens.empty()) {
+        index.forEachTerm([&](const std::string& term) {
+            for (size_t f = 0; f < fuzzyTokens.size(); ++f) {
+                int edits = fuzzyTokens[f].second;
+                if (std::abs((int)term.size() - (int)fuzzyLengths[f]) <= edits && fuzzyTokens[f].first.distanceTo(term) <= edits) {
+                    tokens.push_back(term);
+                    break;
+                }
+            }
+        });
+    }
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+    // Terms of the query in increasing order of their score bound
+    struct RankedTerm {
+        PostingCursor cursor;
+        double weight;     // idf * (k1 + 1)
+        double upperBound; // Highest score the term can add to an image
+    };
+    std::vector<RankedTerm> terms;
+    for (const auto& value : tokens) {
+        IndexTerm found;
+        if (!index.findTerm(value, found)) continue;
+        double weight = bm25Idf(found.documentFrequency, index.size()) * (BM25_K1 + 1);
+        terms.push_back(RankedTerm{index.postingsOf(found), weight, weight * found.maxImpact});
+        terms.back().cursor.next();
+    }
+    std::sort(terms.begin(), terms.end(), [](const RankedTerm& a, const RankedTerm& b) { return a.upperBound < b.upperBound; });
+    std::vector<double> boundBelow(terms.size() + 1, 0); // Summed bounds of the terms before each one
+    for (size_t t = 0; t < terms.size(); ++t) boundBelow[t + 1] = boundBelow[t] + terms[t].upperBound;
+
+    // Min-heap of the best images so far, the weakest on top
+    typedef std::pair<double, uint32_t> Scored;
+    std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored>> best;
+    double threshold = 0;
+    size_t firstEssential = 0; // Terms before it can't make an image enter the heap on their own
+    const double averageTokenCount = index.averageTokenCount();
+    ImageReader reader;
+    std::string title;
+
+    while (topCount > 0) {
+        uint32_t image = UINT32_MAX;
+        for (size_t t = firstEssential; t < terms.size(); ++t)
+            if (!terms[t].cursor.done) image = std::min(image, terms[t].cursor.id);
+        if (image == UINT32_MAX) break;
+
+        const uint32_t tokenCount = index.tokenCount(image);
+        double score = 0;
+        for (size_t t = firstEssential; t < terms.size(); ++t) {
+            PostingCursor& cursor = terms[t].cursor;
+            if (cursor.done || cursor.id != image) continue;
+            score += terms[t].weight * bm25Impact(cursor.count, tokenCount, averageTokenCount);
+            cursor.next();
+        }
+        bool heapFull = best.size() >= topCount;
+        for (size_t t = firstEssential; t-- > 0;) {
+            if (heapFull && score + boundBelow[t + 1] <= threshold) break;
+            PostingCursor& cursor = terms[t].cursor;
+            if (cursor.advanceTo(image) && cursor.id == image)
+                score += terms[t].weight * bm25Impact(cursor.count, tokenCount, averageTokenCount);
+        }
+        if (heapFull && score <= threshold) continue;
+
+        // Only now is the image read, to check that it holds every term as a substring
+        const ImageStore& entries = reader.decode(index.title(image, title), index.block(image), index.rawSize(image));
+        if (!imageMatchesAll(entries, 0, query)) continue;
+
+        best.push(Scored(score, image));
+        if (best.size() > topCount) best.pop();
+        if (best.size() == topCount) {
+            threshold = best.top().first;
+            while (firstEssential < terms.size() && boundBelow[firstEssential + 1] <= threshold) ++firstEssential;
+        }
+    }
+
+    std::vector<uint32_t> ranked(best.size());
+    for (size_t i = ranked.size(); i-- > 0; best.pop()) ranked[i] = best.top().second;
+
+    // Nothing was pruned while the heap was not full, so every scored match is already in it and the other
+    // matches are the candidates left, taken in id order
+    if (ranked.size() < topCount) {
+        std::vector<uint32_t> scored(ranked);
+        std::sort(scored.begin(), scored.end());
+        std::vector<uint32_t> candidates;
+        bool narrowed = selectIndexCandidates(index, query, candidates);
+        size_t candidateCount = narrowed ? candidates.size() : index.size();
+        for (size_t i = 0; i < candidateCount && ranked.size() < topCount; ++i) {
+            uint32_t image = narrowed ? candidates[i] : (uint32_t)i;
+            if (std::binary_search(scored.begin(), scored.end(), image)) continue;
+            const ImageStore& entries = reader.decode(index.title(image, title), index.block(image), index.rawSize(image));
+            if (imageMatchesAll(entries, 0, query)) ranked.push_back(image);
+        }
+    }
+    return ranked;
+}
+
+// Aho-Corasick automaton over a set of lowercase patterns. Every pattern is looked for in one pass over
+// the text, so the scan costs the same whether there are 3 patterns or 3000
+class MultiPatternMatcher {
+private:
+    std::vector<int32_t> transitions; // 256 entries per state, failure links already folded in so scanning never backtracks
+    std::vector<int32_t> patternAt;   // Pattern ending exactly at each state, -1 if none
+    std::vector<int32_t> outputLink;  // Next state down the failure chain that ends a pattern, -1 if none
+    size_t patternCount = 0;
+
+    int32_t addState() {
+        transitions.insert(transitions.end(), 256, -1);
+        patternAt.push_back(-1);
+        outputLink.push_back(-1);
+        return (int32_t)patternAt.size() - 1;
+    }
+
+public:
+    // Builds the automaton, pattern ids are the positions in the vector
+    explicit MultiPatternMatcher(const std::vector<std::string>& patterns) : patternCount(patterns.size()) {
+        addState();
+        for (size_t id = 0; id < patterns.size(); ++id) {
+            int32_t state = 0;
+            for (unsigned char c : patterns[id]) {
+                if (transitions[state * 256 + c] < 0) {
+                    int32_t next = addState();
+                    transitions[state * 256 + c] = next;
+                }
+                state = transitions[state * 256 + c];
+            }
+            patternAt[state] = (int32_t)id;
+        }
+
+        // Breadth first pass to resolve failure links into plain transitions
+        std::vector<int32_t> failure(patternAt.size(), 0);
+        std::queue<int32_t> pending;
+        for (int c = 0; c < 256; ++c) {
+            int32_t& next = transitions[c];
+            if (next < 0) next = 0;
+            else pending.push(next);
+        }
+        while (!pending.empty()) {
+            int32_t state = pending.front();
+            pending.pop();
+            int32_t fail = failure[state];
+            outputLink[state] = patternAt[fail] >= 0 ? fail : outputLink[fail];
+
+            for (int c = 0; c < 256; ++c) {
+                int32_t& next = transitions[state * 256 + c];
+                if (next < 0) {
+                    next = transitions[fail * 256 + c];
+                } else {
+                    failure[next] = transitions[fail * 256 + c];
+                    pending.push(next);
+                }
+            }
+        }
+    }
+
+    size_t size() const { return patternCount; }
+
+    // Scans the text case-insensitively and calls onMatch(patternId) for every occurrence of every pattern.
+    // Returns the state reached, passing it back in continues the scan as if the texts were one
+    template<class OnMatch>
+    int32_t scan(const char* text, size_t length, OnMatch onMatch, int32_t state = 0) const {
+        for (size_t i = 0; i < length; ++i) {
+            state = transitions[state * 256 + (unsigned char)::tolower((unsigned char)text[i])];
+            for (int32_t out = patternAt[state] >= 0 ? state : outputLink[state]; out >= 0; out = outputLink[out])
+                onMatch(patternAt[out]);
+        }
+        return state;
+    }
+};
+
+// A saved query: every one of its terms must match the metadata for the image to go to its destination
+struct SearchRule {
+    std::string destination;             // Subfolder of 'Filtered_Search'
+    std::vector<size_t> patternIds;      // Distinct plain terms of the rule, as ids of the shared matcher
+    std::vector<SearchTerm> otherTerms;  // Regular expressions, fuzzy terms and phrases, checked on their own
+};
+
+// Function to read a rules file. Each line is "<destination> = <comma separated tags>", with the tags written as
+// for --search, blank lines and lines starting with '#' are skipped. Plain terms shared between rules get a single
+// pattern id, the other kinds of terms stay with their rule. Returns false when a term is not valid
+bool loadSearchRules(const std::string& rulesFile, std::vector<SearchRule>& rules, std::vector<std::string>& patterns) {
+    std::ifstream file(rulesFile);
+    if (!file) {
+        std::cerr << "Could not open rules file " << rulesFile << std::endl;
+        return false;
+    }
+
+    std::unordered_map<std::string, size_t> patternIds;
+    std::string line;
+    for (size_t lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#') continue;
+
+        size_t equals = line.find('=');
+        if (equals == std::string::npos) {
+            std::cerr << "Ignoring line " << lineNumber << " of " << rulesFile << ", expected '<destination> = <tags>'" << std::endl;
+            continue;
+        }
+
+        SearchRule rule;
+        rule.destination = sanitizeFolderName(line.substr(0, equals));
+        for (const std::string& word : splitWordsToSearch(line.substr(equals + 1))) {
+            if (word.empty()) continue;
+            SearchTerm term(word);
+            if (!term.error.empty()) {
+                std::cerr << "Invalid search term " << word << " on line " << lineNumber << " of " << rulesFile << ": " << term.error << std::endl;
+                return false;
+            }
+            if (!term.isExact()) {
+                rule.otherTerms.push_back(term);
+                continue;
+            }
+            auto inserted = patternIds.emplace(term.text, patterns.size());
+            if (inserted.second) patterns.push_back(term.text);
+            if (std::find(rule.patternIds.begin(), rule.patternIds.end(), inserted.first->second) == rule.patternIds.end())
+                rule.patternIds.push_back(inserted.first->second);
+        }
+        rules.push_back(rule);
+    }
+    return true;
+}
+
+// Function to route every image by a whole set of rules at once. The metadata of each image is scanned a single
+// time by the shared matcher, then only the rules that contain one of the found terms are looked at, and the rules
+// whose plain terms were all found have their other terms checked on the image. In move mode an image goes to the first rule it matches, link modes place it under every rule it matches.
+// The indices of the images that matched at least one rule are stored in 'matches'
+std::unordered_set<std::string> routeImagesByRules(const ImageStore& store, const std::vector<SearchRule>& rules, const MultiPatternMatcher& matcher,
+                                                   ThreadPool& pool, bool firstRuleOnly, std::vector<uint32_t>& matches) {
+    // Which rules each pattern belongs to, and rules without plain terms, which every image is checked against
+    std::vector<std::vector<size_t>> rulesOfPattern(matcher.size());
+    std::vector<size_t> unconditionalRules;
+    for (size_t r = 0; r < rules.size(); ++r) {
+        for (size_t id : rules[r].patternIds) rulesOfPattern[id].push_back(r);
+        if (rules[r].patternIds.empty()) unconditionalRules.push_back(r);
+    }
+
+    // Each batch evaluates its images and returns the destinations it picked
+    const size_t RULE_BATCH_SIZE = 256;
+    std::vector<std::future<std::vector<std::pair<size_t, size_t>>>> futures;
+    for (size_t begin = 0; begin < store.size(); begin += RULE_BATCH_SIZE) {
+        size_t end = std::min(begin + RULE_BATCH_SIZE, store.size());
+        futures.push_back(pool.enqueue([&, begin, end]() {
+            std::vector<std::pair<size_t, size_t>> routed; // (image, rule)
+            std::vector<size_t> patternSeenBy(matcher.size(), SIZE_MAX); // Image that last saw each pattern, avoids clearing per image
+            std::vector<size_t> termsFound(rules.size(), 0), termsFoundBy(rules.size(), SIZE_MAX);
+            std::vector<size_t> matchedRules;
+            ImageReader reader;
+
+            for (size_t image = begin; image < end; ++image) {
+                matchedRules.assign(unconditionalRules.begin(), unconditionalRules.end());
+                auto onMatch = [&](int32_t id) {
+                    if (patternSeenBy[id] == image) return;
+                    patternSeenBy[id] = image;
+                    for (size_t r : rulesOfPattern[id]) {
+                        if (termsFoundBy[r] != image) {
+                            termsFoundBy[r] = image;
+                            termsFound[r] = 0;
+                        }
+                        if (++termsFound[r] == rules[r].patternIds.size()) matchedRules.push_back(r);
+                    }
+                };
+
+                // The entries are fed as "keyword: value\n", exactly the text a single search looks at
+                int32_t state = 0;
+                size_t viewId;
+                const ImageStore& entries = reader.open(store, image, viewId);
+                for (uint32_t e = entries.entryBegin(viewId); e < entries.entryEnd(viewId); ++e) {
+                    StrRef keyword = entries.keyword(e);
+                    state = matcher.scan(keyword.data, keyword.size, onMatch, state);
+                    state = matcher.scan(": ", 2, onMatch, state);
+                    for (uint32_t l = entries.lineBegin(e); l < entries.lineEnd(e); ++l) {
+                        StrRef line = entries.line(l);
+                        state = matcher.scan(line.data, line.size, onMatch, state);
+                        state = matcher.scan("\n", 1, onMatch, state);
+                    }
+                }
+
+                matchedRules.erase(std::remove_if(matchedRules.begin(), matchedRules.end(), [&](size_t r) {
+                    return !imageMatchesAll(entries, viewId, rules[r].otherTerms);
+                }), matchedRules.end());
+
+                if (firstRuleOnly && !matchedRules.empty())
+                    routed.emplace_back(image, *std::min_element(matchedRules.begin(), matchedRules.end()));
+                else
+                    for (size_t r : matchedRules) routed.emplace_back(image, r);
+            }
+            return routed;
+        }));
+    }
+
+    std::unordered_set<std::string> placements;
+    matches.clear();
+    for (auto& f : futures) {
+        for (const auto& route : f.get()) {
+            placements.insert(rules[route.second].destination + "\\" + store.title(route.first).str());
+            if (matches.empty() || matches.back() != route.first) matches.push_back((uint32_t)route.first);
+        }
+    }
+    return placements;
+}
+
+// Returns true when both paths live on the same volume, so a rename is a metadata-only operation
+bool IsSameVolume(const std::string& pathA, const std::string& pathB) {
+    char volumeA[MAX_PATH], volumeB[MAX_PATH];
+    if (!GetVolumePathNameA(pathA.c_str(), volumeA, MAX_PATH) || !GetVolumePathNameA(pathB.c_str(), volumeB, MAX_PATH))
+        return true; // Let MoveFileExA decide, it falls back to a copy on its own when needed
+    return _stricmp(volumeA, volumeB) == 0;
+}
+
+// Moves one file, renaming on the same volume and copying then deleting across volumes
+DWORD moveSingleImage(const std::string& sourcePath, const std::string& destPath, bool sameVolume) {
+    if (sameVolume) {
+        if (MoveFileExA(sourcePath.c_str(), destPath.c_str(), 0)) return 0;
+        if (GetLastError() != ERROR_NOT_SAME_DEVICE) return GetLastError();
+    }
+
+    // CopyFileExA lets the kernel (and the storage stack, where it supports offloaded copies or block cloning) move the bytes
+    if (!CopyFileExA(sourcePath.c_str(), destPath.c_str(), NULL, NULL, NULL, COPY_FILE_FAIL_IF_EXISTS))
+        return GetLastError();
+    if (!DeleteFileA(sourcePath.c_str())) return GetLastError();
+    return 0;
+}
+
+// Places one match in 'Filtered_Search' according to the output mode, returns 0 or the Windows error code
+DWORD placeSingleImage(const std::string& sourcePath, const std::string& destPath, const std::string& subfolder, const std::string& title, OutputMode mode, bool sameVolume) {
+    switch (mode) {
+        case OutputMode::Symlink: {
+            // A relative target keeps the farm valid if the whole folder is moved or accessed through another drive letter
+            std::string target = "..\\";
+            for (char c : subfolder) {
+                if (c == '\\') target += "..\\";
+            }
+            if (!subfolder.empty()) target += "..\\";
+            target += title + ".png";
+            if (!CreateSymbolicLinkA(destPath.c_str(), target.c_str(), SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE))
+                return GetLastError();
+            return 0;
+        }
+        case OutputMode::Hardlink:
+            if (!CreateHardLinkA(destPath.c_str(), sourcePath.c_str(), NULL)) return GetLastError();
+            return 0;
+        default:
+            return moveSingleImage(sourcePath, destPath, sameVolume);
+    }
+}
+
+// Function to list the .png entries already sitting in a folder, mapped to their file attributes.
+// Group subfolders one level down are listed too, their entries are keyed as "<subfolder>\\<title>"
+std::unordered_map<std::string, DWORD> listFolderImages(const std::string& folder, bool includeSubfolders = true) {
+    std::unordered_map<std::string, DWORD> images;
+    WIN32_FIND_DATAA findFileData;
+    std::string searchPath = folder + "\\*.*";
+
+    HANDLE hFind = FindFirstFileA(searchPath.c_str(), &findFileData);
+    if (hFind == INVALID_HANDLE_VALUE) return images;
+
+    std::vector<std::string> subfolders;
+    do {
+        std::string fileName = findFileData.cFileName;
+        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            if (includeSubfolders && fileName != "." && fileName != "..") subfolders.push_back(fileName);
+        } else if (fileName.length() > 4 && fileName.compare(fileName.length() - 4, 4, ".png") == 0) {
+            images.emplace(fileName.substr(0, fileName.length() - 4), findFileData.dwFileAttributes);
+        }
+    } while (FindNextFileA(hFind, &findFileData) != 0);
+
+    FindClose(hFind);
+
+    for (const auto& subfolder : subfolders) {
+        for (const auto& pair : listFolderImages(folder + "\\" + subfolder, false))
+            images.emplace(subfolder + "\\" + pair.first, pair.second);
+    }
+    return images;
+}
+
+// Splits a 'Filtered_Search' entry key into its subfolder (possibly empty) and its title
+std::string subfolderOfKey(const std::string& key) {
+    size_t slash = key.rfind('\\');
+    return slash == std::string::npos ? std::string() : key.substr(0, slash);
+}
+
+std::string titleOfKey(const std::string& key) {
+    size_t slash = key.rfind('\\');
+    return slash == std::string::npos ? key : key.substr(slash + 1);
+}
+
+// Returns true when the file has more than one name on disk, i.e. removing this one loses no data
+bool HasOtherHardLinks(const std::string& path) {
+    HANDLE file = CreateFileA(path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    BY_HANDLE_FILE_INFORMATION info;
+    bool linked = GetFileInformationByHandle(file, &info) && info.nNumberOfLinks > 1;
+    CloseHandle(file);
+    return linked;
+}
+
+// Takes an entry that no longer matches out of 'Filtered_Search' without ever losing an image:
+// links are deleted, images that were moved there by an earlier run are moved back to the source folder
+DWORD removeStaleImage(const std::string& filteredPath, const std::string& sourcePath, DWORD attributes, bool sameVolume) {
+    if (GetFileAttributesA(sourcePath.c_str()) == INVALID_FILE_ATTRIBUTES)
+        return moveSingleImage(filteredPath, sourcePath, sameVolume);
+
+    if ((attributes & FILE_ATTRIBUTE_REPARSE_POINT) || HasOtherHardLinks(filteredPath)) {
+        if (!DeleteFileA(filteredPath.c_str())) return GetLastError();
+        return 0;
+    }
+
+    // A real file with the same name exists in both folders, leave both alone
+    return ERROR_ALREADY_EXISTS;
+}
+
+// Runs an action over a list of entry keys in batches on the pool, the action gets two reusable path buffers
+// and returns 0 or a Windows error code. Failures are collected and handed back to the caller
+template<class Action>
+std::vector<std::pair<std::string, DWORD>> runImageBatches(ThreadPool& pool, const std::vector<const std::string*>& keys, Action action) {
+    const size_t MOVE_BATCH_SIZE = 512;
+    std::vector<std::future<std::vector<std::pair<std::string, DWORD>>>> futures;
+    for (size_t begin = 0; begin < keys.size(); begin += MOVE_BATCH_SIZE) {
+        size_t end = std::min(begin + MOVE_BATCH_SIZE, keys.size());
+        futures.push_back(pool.enqueue([&keys, action, begin, end]() {
+            std::vector<std::pair<std::string, DWORD>> failures;
+            std::string pathA, pathB;
+            for (size_t i = begin; i < end; ++i) {
+                DWORD error = action(*keys[i], pathA, pathB);
+                if (error != 0) failures.emplace_back(*keys[i], error);
+            }
+            return failures;
+        }));
+    }
+
+    std::vector<std::pair<std::string, DWORD>> failures;
+    for (auto& f : futures) {
+        std::vector<std::pair<std::string, DWORD>> batchFailures = f.get();
+        failures.insert(failures.end(), batchFailures.begin(), batchFailures.end());
+    }
+    return failures;
+}
+
+// Function to move (or link, depending on the output mode) filtered images to a new or existing folder.
+// Each placement is an entry key, "<title>" or "<subfolder>\\<title>" relative to 'Filtered_Search'.
+// 'Filtered_Search' is updated in place: entries that still match are left alone, only new matches are
+// added and only stale entries are taken out, so a re-run costs time proportional to what changed
+void moveFilteredImages(const std::unordered_set<std::string>& placements, const std::string& folderPath,
+                        const std::unordered_map<std::string, DWORD>& existingImages, ThreadPool& pool, OutputMode mode) {
+    std::string filteredFolder = folderPath + "\\Filtered_Search";
+
+    // Create 'Filtered_Search' directory, and the group subfolders the placements need
+    std::unordered_set<std::string> subfolders;
+    for (const auto& key : placements) {
+        std::string subfolder = subfolderOfKey(key);
+        if (!subfolder.empty()) subfolders.insert(subfolder);
+    }
+    std::vector<std::string> foldersToCreate(1, filteredFolder);
+    for (const auto& subfolder : subfolders) foldersToCreate.push_back(filteredFolder + "\\" + subfolder);
+
+    for (const auto& folder : foldersToCreate) {
+        if (!CreateDirectoryA(folder.c_str(), NULL)) {
+            if (GetLastError() != ERROR_ALREADY_EXISTS) {
+                std::cerr << "Failed to create directory " << folder << ": " << GetLastError() << std::endl;
+                return;
+            }
+        }
+    }
+
+    const bool sameVolume = IsSameVolume(folderPath, filteredFolder);
+
+    // Diff the matches against what is already there
+    std::vector<const std::string*> toAdd, toRemove;
+    for (const auto& key : placements) {
+        if (existingImages.find(key) == existingImages.end()) toAdd.push_back(&key);
+    }
+    for (const auto& pair : existingImages) {
+        if (placements.find(pair.first) == placements.end()) toRemove.push_back(&pair.first);
+    }
+
+    // Stale entries go first, so an image that changes group is back in the source folder before it is placed again
+    auto removeFailures = runImageBatches(pool, toRemove,
+        [&](const std::string& key, std::string& sourcePath, std::string& filteredPath) {
+            sourcePath.assign(folderPath).append("\\").append(titleOfKey(key)).append(".png");
+            filteredPath.assign(filteredFolder).append("\\").append(key).append(".png");
+            return removeStaleImage(filteredPath, sourcePath, existingImages.at(key), sameVolume);
+        });
+
+    auto addFailures = runImageBatches(pool, toAdd,
+        [&](const std::string& key, std::string& sourcePath, std::string& destPath) {
+            std::string title = titleOfKey(key);
+            sourcePath.assign(folderPath).append("\\").append(title).append(".png");
+            destPath.assign(filteredFolder).append("\\").append(key).append(".png");
+            return placeSingleImage(sourcePath, destPath, subfolderOfKey(key), title, mode, sameVolume);
+        });
+
+    // Group subfolders emptied by this run go away, RemoveDirectoryA leaves non-empty ones alone
+    for (const auto* key : toRemove) {
+        std::string subfolder = subfolderOfKey(*key);
+        if (!subfolder.empty() && subfolders.find(subfolder) == subfolders.end())
+            RemoveDirectoryA((filteredFolder + "\\" + subfolder).c_str());
+    }
+
+    // Report failures from the main thread so messages don't interleave
+    for (const auto& failure : removeFailures)
+        std::cerr << "Failed to remove stale entry " << failure.first << ".png: " << failure.second << std::endl;
+    for (const auto& failure : addFailures)
+        std::cerr << "Failed to " << (mode == OutputMode::Move ? "move" : "link") << " file " << failure.first << ".png: " << failure.second << std::endl;
+
+    std::cout << "\nFiltered_Search updated: " << toAdd.size() - addFailures.size() << " added, "
+              << toRemove.size() - removeFailures.size() << " removed, "
+              << placements.size() - toAdd.size() << " already in place." << std::endl;
+}
+
+// Function to put the images an earlier move run left in 'Filtered_Search' back into the source folder. A link run
+// calls it before scanning, so its farm is built over every image of the folder in one run. Links are left alone,
+// as are real files whose name is also taken in the source folder
+void restoreMovedImages(const std::string& folderPath, ThreadPool& pool) {
+    std::string filteredFolder = folderPath + "\\Filtered_Search";
+    std::unordered_map<std::string, DWORD> existingImages = listFolderImages(filteredFolder);
+    if (existingImages.empty()) return;
+
+    const bool sameVolume = IsSameVolume(folderPath, filteredFolder);
+    std::vector<const std::string*> moved;
+    std::string sourcePath;
+    for (const auto& pair : existingImages) {
+        sourcePath.assign(folderPath).append("\\").append(titleOfKey(pair.first)).append(".png");
+        if (!(pair.second & FILE_ATTRIBUTE_REPARSE_POINT) && GetFileAttributesA(sourcePath.c_str()) == INVALID_FILE_ATTRIBUTES)
+            moved.push_back(&pair.first);
+    }
+
+    auto failures = runImageBatches(pool, moved,
+        [&](const std::string& key, std::string& filteredPath, std::string& sourcePath) {
+            filteredPath.assign(filteredFolder).append("\\").append(key).append(".png");
+            sourcePath.assign(folderPath).append("\\").append(titleOfKey(key)).append(".png");
+            return moveSingleImage(filteredPath, sourcePath, sameVolume);
+        });
+
+    // Group subfolders emptied here go away, RemoveDirectoryA leaves non-empty ones alone
+    for (const auto* key : moved) {
+        std::string subfolder = subfolderOfKey(*key);
+        if (!subfolder.empty()) RemoveDirectoryA((filteredFolder + "\\" + subfolder).c_str());
+    }
+    for (const auto& failure : failures)
+        std::cerr << "Failed to move " << failure.first << ".png back to the source folder: " << failure.second << std::endl;
+}
+
+// Looks up a metadata field of an image, either a tEXt keyword ("Software") or one of the "Name: value" pairs that
+// generators pack into the parameters text ("Sampler", "Model hash", "Size"). The match is case-insensitive,
+// a pair must start a line or follow a ", " separator, and the value runs up to the next comma or line break
+StrRef extractMetadataField(const ImageStore& store, size_t id, const std::string& field) {
+    auto equalsIgnoreCase = [](char a, char b) { return ::tolower((unsigned char)a) == ::tolower((unsigned char)b); };
+    auto untilSeparator = [](const char* start, const char* end) {
+        const char* stop = start;
+        while (stop != end && *stop != ',' && *stop != '\n') ++stop;
+        return StrRef(start, stop - start);
+    };
+
+    // A tEXt keyword with that name wins
+    for (uint32_t e = store.entryBegin(id); e < store.entryEnd(id); ++e) {
+        StrRef keyword = store.keyword(e);
+        if (keyword.size == field.size() && std::equal(field.begin(), field.end(), keyword.data, equalsIgnoreCase)) {
+            StrRef firstLine = store.line(store.lineBegin(e));
+            return untilSeparator(firstLine.data, firstLine.data + firstLine.size);
+        }
+    }
+
+    std::string needle = field + ": ";
+    std::transform(needle.begin(), needle.end(), needle.begin(), ::tolower);
+    auto matchesNeedle = [](char a, char b) { return ::tolower((unsigned char)a) == b; };
+
+    // The value lines of all entries of an image sit next to each other
+    for (uint32_t l = store.lineBegin(store.entryBegin(id)); l < store.lineBegin(store.entryEnd(id)); ++l) {
+        StrRef line = store.line(l);
+        const char* end = line.data + line.size;
+        for (const char* pos = line.data; ; ++pos) {
+            pos = std::search(pos, end, needle.begin(), needle.end(), matchesNeedle);
+            if (pos == end) break;
+
+            bool startsField = pos == line.data || (pos - line.data >= 2 && pos[-1] == ' ' && pos[-2] == ',');
+            if (startsField) return untilSeparator(pos + needle.size(), end);
+        }
+    }
+    return StrRef();
+}
+
+// Turns a metadata value into something Windows accepts as a folder name
+std::string sanitizeFolderName(StrRef value) {
+    const size_t MAX_FOLDER_NAME = 100;
+    std::string name;
+    for (size_t i = 0; i < value.size && name.size() < MAX_FOLDER_NAME; ++i) {
+        unsigned char c = value.data[i];
+        name += (c < 0x20 || strchr("<>:\"/\\|?*", c)) ? '_' : (char)c;
+    }
+
+    // Trailing dots and spaces are silently dropped by Windows, leading spaces are just confusing
+    size_t start = name.find_first_not_of(' ');
+    size_t end = name.find_last_not_of(". ");
+    if (start == std::string::npos || end == std::string::npos || end < start) return "Unknown";
+    return name.substr(start, end - start + 1);
+}
+
+// Function to decide where each match goes inside 'Filtered_Search'. Without a group field every match
+// sits at the top level, with one each match is routed into the subfolder named after its value of that field
+std::unordered_set<std::string> routeFilteredImages(const ImageStore& store, const std::vector<uint32_t>& matches, const std::string& groupBy) {
+    std::unordered_set<std::string> placements;
+    placements.reserve(matches.size());
+    ImageReader reader;
+    for (uint32_t id : matches) {
+        if (groupBy.empty()) {
+            placements.insert(store.title(id).str());
+        } else {
+            size_t viewId;
+            const ImageStore& image = reader.open(store, id, viewId);
+            placements.insert(sanitizeFolderName(extractMetadataField(image, viewId, groupBy)) + "\\" + store.title(id).str());
+        }
+    }
+    return placements;
+}
+
+// Appends a string to a JSON document, escaping it and widening the Latin-1 bytes of tEXt chunks to UTF-8
+void appendJsonString(std::string& out, StrRef value) {
+    static const char hexDigits[] = "0123456789abcdef";
+    out += '"';
+    for (size_t i = 0; i < value.size; ++i) {
+        unsigned char c = value.data[i];
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hexDigits[c >> 4];
+                    out += hexDigits[c & 0xF];
+                } else if (c >= 0x80) {
+                    out += (char)(0xC0 | (c >> 6));
+                    out += (char)(0x80 | (c & 0x3F));
+                } else {
+                    out += (char)c;
+                }
+        }
+    }
+    out += '"';
+}
+
+// Function to write the filtered images as a list instead of moving them, the source folder is left untouched
+void writeFilteredList(const ImageStore& store, const std::vector<uint32_t>& matches, const std::string& folderPath, const SearchOptions& options) {
+    FILE* out = stdout;
+    if (!options.outputFile.empty()) {
+        out = fopen(options.outputFile.c_str(), "wb");
+        if (!out) {
+            std::cerr << "Failed to open output file " << options.outputFile << std::endl;
+            return;
+        }
+    } else {
+        std::cout.flush();
+        _setmode(_fileno(stdout), _O_BINARY); // Keep NUL separators and newlines byte exact
+    }
+
+    // Everything goes through one large buffer that is flushed in big writes
+    const size_t FLUSH_THRESHOLD = 1 << 20;
+    std::string buffer;
+    buffer.reserve(FLUSH_THRESHOLD + 4096);
+
+    std::string path;
+    ImageReader reader;
+    for (uint32_t id : matches) {
+        StrRef title = store.title(id);
+        path.assign(folderPath).append("\\").append(title.data, title.size).append(".png");
+
+        if (options.outputMode == OutputMode::Ndjson) {
+            buffer += "{\"path\":";
+            appendJsonString(buffer, path);
+            buffer += ",\"title\":";
+            appendJsonString(buffer, title);
+            buffer += ",\"metadata\":{";
+            size_t viewId;
+            const ImageStore& image = reader.open(store, id, viewId);
+            for (uint32_t e = image.entryBegin(viewId); e < image.entryEnd(viewId); ++e) {
+                if (e != image.entryBegin(viewId)) buffer += ',';
+                appendJsonString(buffer, image.keyword(e));
+                buffer += ':';
+                appendJsonString(buffer, image.value(e));
+            }
+            buffer += "}}\n";
+        } else {
+            buffer += path;
+            buffer += options.outputMode == OutputMode::List0 ? '\0' : '\n';
+        }
+
+        if (buffer.size() >= FLUSH_THRESHOLD) {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+    }
+    fwrite(buffer.data(), 1, buffer.size(), out);
+
+    if (out != stdout) fclose(out);
+    else fflush(out);
+}
+
+// Calls onLora(name) once for every LoRA an image's prompt loads through <lora:name:weight> tags
+template<class OnLora>
+void forEachLora(const ImageStore& store, size_t id, std::vector<StrRef>& scratch, OnLora onLora) {
+    static const std::string TAG = "<lora:";
+    auto matchesTag = [](char a, char b) { return ::tolower((unsigned char)a) == b; };
+    scratch.clear();
+    for (uint32_t l = store.lineBegin(store.entryBegin(id)); l < store.lineBegin(store.entryEnd(id)); ++l) {
+        StrRef line = store.line(l);
+        const char* end = line.data + line.size;
+        for (const char* pos = line.data; (pos = std::search(pos, end, TAG.begin(), TAG.end(), matchesTag)) != end;) {
+            pos += TAG.size();
+            const char* stop = pos;
+            while (stop != end && *stop != ':' && *stop != '>') ++stop;
+            if (stop != pos) scratch.push_back(StrRef(pos, stop - pos));
+        }
+    }
+
+    // An image loading the same LoRA twice still counts once
+    auto less = [](StrRef a, StrRef b) {
+        int result = memcmp(a.data, b.data, std::min(a.size, b.size));
+        return result != 0 ? result < 0 : a.size < b.size;
+    };
+    auto equal = [](StrRef a, StrRef b) { return a.size == b.size && memcmp(a.data, b.data, a.size) == 0; };
+    std::sort(scratch.begin(), scratch.end(), less);
+    scratch.erase(std::unique(scratch.begin(), scratch.end(), equal), scratch.end());
+    for (StrRef name : scratch) onLora(name);
+}
+
+typedef std::unordered_map<std::string, uint32_t> FacetCounts; // Value -> images holding it
+
+// Function to count, per facet field, how many of the images matching every search term hold each value. A field
+// is read like --group-by reads it, and the field "lora" counts the LoRAs of the prompt instead. Batches of images
+// run on the pool, each filtering its images and counting the matches in hash tables of its own, and the tables are
+// merged once every batch is done. 'matchCount' receives the number of matches
+std::vector<FacetCounts> aggregateFacets(const ImageStore& store, const std::vector<std::string>& wordsToSearch, const std::vector<std::string>& fields,
+                                         ThreadPool& pool, size_t& matchCount) {
+    const size_t FACET_BATCH_SIZE = 4096;
+    std::vector<SearchTerm> terms = parseSearchTerms(wordsToSearch);
+    std::vector<uint64_t> trigramHashes = requiredTrigramHashes(terms);
+    std::vector<bool> isLora;
+    for (const auto& field : fields) {
+        std::string name = field;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        isLora.push_back(name == "lora");
+    }
+
+    std::vector<std::future<std::pair<size_t, std::vector<FacetCounts>>>> futures; // (matches, counts)
+    for (size_t begin = 0; begin < store.size(); begin += FACET_BATCH_SIZE) {
+        size_t end = std::min(begin + FACET_BATCH_SIZE, store.size());
+        futures.push_back(pool.enqueue([&, begin, end]() {
+            std::vector<FacetCounts> counts(fields.size());
+            size_t matched = 0;
+            ImageReader reader;
+            std::vector<StrRef> loras;
+            for (size_t id = begin; id < end; ++id) {
+                if (!store.mayContain(id, trigramHashes)) continue;
+                size_t viewId;
+                const ImageStore& image = reader.open(store, id, viewId);
+                if (!imageMatchesAll(image, viewId, terms)) continue;
+                ++matched;
+                for (size_t f = 0; f < fields.size(); ++f) {
+                    if (isLora[f]) {
+                        forEachLora(image, viewId, loras, [&](StrRef name) { ++counts[f][name.str()]; });
+                        continue;
+                    }
+                    StrRef value = extractMetadataField(image, viewId, fields[f]);
+                    if (!value.empty()) ++counts[f][value.str()];
+                }
+            }
+            return std::make_pair(matched, std::move(counts));
+        }));
+    }
+
+    std::vector<FacetCounts> merged(fields.size());
+    matchCount = 0;
+    for (auto& f : futures) {
+        std::pair<size_t, std::vector<FacetCounts>> batch = f.get();
+        matchCount += batch.first;
+        std::vector<FacetCounts>& counts = batch.second;
+        for (size_t field = 0; field < fields.size(); ++field) {
+            if (merged[field].empty()) merged[field].swap(counts[field]);
+            else for (const auto& pair : counts[field]) merged[field][pair.first] += pair.second;
+        }
+    }
+    return merged;
+}
+
+// Function to print facet counts as "field<TAB>value<TAB>images" lines, each field's values from the most common
+void writeFacets(const std::vector<std::string>& fields, const std::vector<FacetCounts>& counts, const SearchOptions& options) {
+    std::string buffer;
+    for (size_t f = 0; f < fields.size(); ++f) {
+        std::vector<std::pair<std::string, uint32_t>> values(counts[f].begin(), counts[f].end());
+        std::sort(values.begin(), values.end(), [](const std::pair<std::string, uint32_t>& a, const std::pair<std::string, uint32_t>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        for (const auto& value : values)
+            buffer.append(fields[f]).append("\t").append(value.first).append("\t").append(std::to_string(value.second)).append("\n");
+    }
+    writeResults(buffer, options);
+}
+
+// Function to print completions as "word<TAB>images holding it" lines, to the output file if one was given
+void writeCompletions(const std::vector<std::pair<std::string, uint32_t>>& completions, const SearchOptions& options) {
+    std::string buffer;
+    for (const auto& completion : completions) buffer.append(completion.first).append("\t").append(std::to_string(completion.second)).append("\n");
+    writeResults(buffer, options);
+}
+
+// Maps an --output value to its mode
+bool parseOutputMode(const std::string& name, OutputMode& mode) {
+    if (name == "move") mode = OutputMode::Move;
+    else if (name == "list") mode = OutputMode::List;
+    else if (name == "list0") mode = OutputMode::List0;
+    else if (name == "ndjson") mode = OutputMode::Ndjson;
+    else if (name == "symlink") mode = OutputMode::Symlink;
+    else if (name == "hardlink") mode = OutputMode::Hardlink;
+    else if (name == "count") mode = OutputMode::Count;
+    else if (name == "exists") mode = OutputMode::Exists;
+    else return false;
+    return true;
+}
+
+// Prints the command line usage
+void printUsage(const char* programName) {
+    std::cerr << "Usage: " << programName << " [options]\n"
+              << "  --folder <path>      Folder to filter, asked for interactively when missing\n"
+              << "  --search <tags>      Comma separated tags, asked for interactively when missing\n"
+              << "  --output <mode>      move (default), list, list0, ndjson, symlink, hardlink, count or exists\n"
+              << "  --out-file <path>    Write list, list0 and ndjson output to a file instead of the console\n"
+              << "  --group-by <field>   Sort the matches into Filtered_Search\\<value> by a metadata field, e.g. Sampler\n"
+              << "  --rules <file>       Run every '<destination> = <tags>' line of the file in one scan instead of --search\n"
+              << "  --compress           Keep the metadata compressed in memory, only candidates are decompressed\n"
+              << "  --index <file>       Query this index file instead of scanning, it is rebuilt when the folder changed\n"
+              << "  --top <n>            Keep the n matches ranked most relevant by BM25, best first. Needs --index\n"
+              << "  --complete <prefix>  Print the indexed words starting with prefix, the most frequent first (10, or --top)\n"
+              << "  --facets <fields>    Count the matches per value of each comma separated field, e.g. Sampler,Size,lora\n"
+              << "  --estimate           Estimate the number of matches from random files, refined until Ctrl+C\n"
+              << "  --limit <n>          Stop the scan as soon as n matches were found\n"
+              << "  --deadline-ms <ms>   Stop the scan after this many milliseconds and keep what was found\n"
+              << "  --order <order>      Read the files newest first (mtime), smallest first (size), by name or in disk order (disk)\n"
+              << "  --direct-io          Read the files past the system file cache, leaving it to other programs\n";
+}
+
+// Function to read the command line into the search options, returns false on invalid usage
+bool parseOptions(int argc, char* argv[], SearchOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--folder" && hasValue) {
+            options.folderPath = argv[++i];
+        } else if (arg == "--search" && hasValue) {
+            options.wordsToSearch = argv[++i];
+            options.hasWordsToSearch = true;
+        } else if (arg == "--output" && hasValue) {
+            if (!parseOutputMode(argv[++i], options.outputMode)) {
+                std::cerr << "Unknown output mode: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--out-file" && hasValue) {
+            options.outputFile = argv[++i];
+        } else if (arg == "--group-by" && hasValue) {
+            options.groupBy = argv[++i];
+        } else if (arg == "--rules" && hasValue) {
+            options.rulesFile = argv[++i];
+        } else if (arg == "--compress") {
+            options.compress = true;
+        } else if (arg == "--index" && hasValue) {
+            options.indexFile = argv[++i];
+        } else if (arg == "--facets" && hasValue) {
+            for (const auto& field : splitWordsToSearch(argv[++i])) {
+                if (!field.empty()) options.facets.push_back(field);
+            }
+            if (options.facets.empty()) {
+                std::cerr << "No facet fields in: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--estimate") {
+            options.estimate = true;
+        } else if (arg == "--direct-io") {
+            options.readMode = ReadMode::Direct;
+        } else if (arg == "--complete" && hasValue) {
+            options.completePrefix = argv[++i];
+            options.hasCompletePrefix = true;
+        } else if (arg == "--limit" && hasValue) {
+            char* end;
+            options.limit = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || options.limit == 0) {
+                std::cerr << "Invalid match limit: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--order" && hasValue) {
+            std::string order = argv[++i];
+            if (order == "mtime") options.fileOrder = FileOrder::Newest;
+            else if (order == "size") options.fileOrder = FileOrder::Smallest;
+            else if (order == "name") options.fileOrder = FileOrder::Name;
+            else if (order == "disk") options.fileOrder = FileOrder::Physical;
+            else {
+                std::cerr << "Unknown file order: " << order << std::endl;
+                return false;
+            }
+        } else if (arg == "--deadline-ms" && hasValue) {
+            char* end;
+            options.deadlineMs = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || options.deadlineMs == 0) {
+                std::cerr << "Invalid deadline: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--top" && hasValue) {
+            char* end;
+            options.topCount = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || options.topCount == 0) {
+                std::cerr << "Invalid result count: " << argv[i] << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            return false;
+        }
+    }
+
+    // Ranking and completion read the index, and ranking only makes sense where the order of the results shows
+    if ((options.topCount > 0 || options.hasCompletePrefix) && options.indexFile.empty()) {
+        std::cerr << (options.hasCompletePrefix ? "--complete" : "--top") << " needs an --index file to read from" << std::endl;
+        return false;
+    }
+    if (options.hasCompletePrefix && !options.rulesFile.empty()) {
+        std::cerr << "--complete can't be combined with --rules" << std::endl;
+        return false;
+    }
+    if (!options.facets.empty() && (!options.rulesFile.empty() || options.topCount > 0 || options.hasCompletePrefix)) {
+        std::cerr << "--facets can't be combined with --rules, --top or --complete" << std::endl;
+        return false;
+    }
+    if (options.isCountMode() && (!options.rulesFile.empty() || options.topCount > 0 || !options.facets.empty())) {
+        std::cerr << "The count and exists outputs can't be combined with --rules, --top or --facets" << std::endl;
+        return false;
+    }
+    bool boundedScan = options.limit > 0 || options.deadlineMs > 0;
+    if (boundedScan && (options.outputMode == OutputMode::Move || options.isCountMode() || !options.rulesFile.empty() ||
+                        options.topCount > 0 || !options.facets.empty() || options.estimate)) {
+        std::cerr << "--limit and --deadline-ms work with a search and list, list0, ndjson, symlink or hardlink output" << std::endl;
+        return false;
+    }
+    if (options.deadlineMs > 0 && !options.indexFile.empty()) {
+        std::cerr << "--deadline-ms bounds a scan of the folder and can't be combined with --index" << std::endl;
+        return false;
+    }
+    if (options.estimate && (!options.rulesFile.empty() || !options.indexFile.empty() || !options.facets.empty() || options.isCountMode())) {
+        std::cerr << "--estimate reads the folder itself and can't be combined with --rules, --index, --facets or a count output" << std::endl;
+        return false;
+    }
+    if (options.fileOrder != FileOrder::Directory && (!options.indexFile.empty() || options.estimate)) {
+        std::cerr << "--order only applies to a scan of the folder, not to --index or --estimate" << std::endl;
+        return false;
+    }
+    if (options.topCount > 0 && !options.hasCompletePrefix && (options.outputMode == OutputMode::Move || !options.rulesFile.empty())) {
+        std::cerr << "--top works with a search and list, list0, ndjson, symlink or hardlink output" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Function to get the search, asked for interactively unless it was given, split into its terms. False when one of
+// the terms is not valid
+bool readSearchTerms(const SearchOptions& options, std::ostream& console, std::vector<std::string>& searchTerms) {
+    std::string wordsToSearch = options.wordsToSearch;
+    if (!options.hasWordsToSearch && options.facets.empty()) {
+        console << "\nPlease enter comma separated tags so the program knows what you are searching for: ";
+        std::getline(std::cin, wordsToSearch);
+    }
+
+    console << "\nYou are searching for: " << wordsToSearch << std::endl;
+
+    // Return a vector of the words that were split
+    searchTerms = splitWordsToSearch(wordsToSearch);
+    std::vector<SearchTerm> parsedTerms = parseSearchTerms(searchTerms);
+    for (size_t t = 0; t < parsedTerms.size(); ++t) {
+        if (parsedTerms[t].error.empty()) continue;
+        std::cerr << "Invalid search term " << searchTerms[t] << ": " << parsedTerms[t].error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    int pngCount = 0;
+    SearchOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    const auto startTime = std::chrono::steady_clock::now();
+
+    // When the results themselves go to the console, the conversation with the user moves to stderr
+    bool printsResults = options.isListMode() || options.isCountMode() || options.hasCompletePrefix || !options.facets.empty() || options.estimate;
+    std::ostream& console = (printsResults && options.outputFile.empty()) ? std::cerr : std::cout;
+    std::string folderPath = options.folderPath;
+
+    // Rules are read up front so a broken file fails before the folder is scanned
+    std::vector<SearchRule> rules;
+    std::vector<std::string> rulePatterns;
+    if (!options.rulesFile.empty() && !loadSearchRules(options.rulesFile, rules, rulePatterns)) return 1;
+
+    console << "\n This program serves to filter images of a given folder using the textual PNG metadata of said images.";
+
+    // Loop for valid directory input
+    while (!DirectoryExists(folderPath.c_str())) {
+        if (!folderPath.empty())
+            console << "\nInvalid folder path, or the directory does not exist... \nPlease try again.\n";
+        console << "\nPlease enter a valid folder path: ";
+        if (!std::getline(std::cin, folderPath)) return 1;
+    }
+    console << "\n You have entered a valid folder path.";
+
+    // Create threadpool
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    // Images a move run left in 'Filtered_Search' are back in the folder before it is counted and scanned for links
+    if (options.outputMode == OutputMode::Symlink || options.outputMode == OutputMode::Hardlink) restoreMovedImages(folderPath, pool);
+    console << "\n There are " << countPngFiles(folderPath.c_str(), pngCount) << " .png files in that folder.";
+
+    if (options.estimate) {
+        // A sample of the files answers before the folder would have been scanned
+        std::vector<std::string> searchTerms;
+        if (!readSearchTerms(options, console, searchTerms)) return 1;
+        estimateMatches(folderPath, searchTerms, options, pool, console);
+        return 0;
+    }
+
+    if (options.outputMode == OutputMode::Exists && options.indexFile.empty()) {
+        // The scan filters as it reads and a limit of one match stops it, so the rest of the folder is never read
+        std::vector<std::string> searchTerms;
+        if (!readSearchTerms(options, console, searchTerms)) return 1;
+        ScanLimits limits;
+        limits.order = options.fileOrder;
+        limits.readMode = options.readMode;
+        limits.maxMatches = 1;
+        ImageStore store;
+        double progress;
+        writeResults(scanMatches(folderPath, searchTerms, limits, store, pool, progress).empty() ? "no\n" : "yes\n", options);
+        return 0;
+    }
+
+    if ((options.limit > 0 || options.deadlineMs > 0) && options.indexFile.empty()) {
+        // The scan filters as it goes and stops at the limit or the deadline, only the matches are kept
+        std::vector<std::string> searchTerms;
+        if (!readSearchTerms(options, console, searchTerms)) return 1;
+        ScanLimits limits;
+        limits.order = options.fileOrder;
+        limits.readMode = options.readMode;
+        limits.maxMatches = options.limit;
+        limits.hasDeadline = options.deadlineMs > 0;
+        limits.deadline = startTime + std::chrono::milliseconds(options.deadlineMs);
+        ImageStore store;
+        double progress;
+        std::vector<uint32_t> matches = scanMatches(folderPath, searchTerms, limits, store, pool, progress);
+        console << "Found " << matches.size() << " matches in " << std::floor(progress * 1000) / 10 << "% of the files";
+        if (progress < 1) console << ", the results are partial";
+        console << "." << std::endl;
+
+        if (options.isListMode())
+            writeFilteredList(store, matches, folderPath, options);
+        else
+            moveFilteredImages(routeFilteredImages(store, matches, options.groupBy), folderPath, listFolderImages(folderPath + "\\Filtered_Search"),
+                               pool, options.outputMode);
+        return 0;
+    }
+
+    // Create an empty store
+    ImageStore store;
+
+    // An up to date index replaces the scan of the folder, the query then only loads the images it needs from it
+    MappedIndex index;
+    uint64_t folderStamp = options.indexFile.empty() ? 0 : getFolderStamp(folderPath);
+    if (!options.indexFile.empty() && index.open(options.indexFile, folderStamp)) {
+        console << "\nUsing the index " << options.indexFile << " of " << index.size() << " images.";
+    } else {
+        store.compressed = options.compress;
+        reserveDictionary(store, pngCount);
+        console << "\nA dictionary has been instantiated and has enough space for " << pngCount << " key/value pairs.";
+
+        fillDictionaryWithImageMetadata(folderPath, store, pool, options.fileOrder, options.readMode);
+        if (!options.indexFile.empty() && writeIndexFile(store, store.size(), options.indexFile, folderStamp))
+            console << "\nThe index " << options.indexFile << " has been written for the next runs.";
+    }
+
+    if (options.hasCompletePrefix) {
+        // Completions come from the trie of the index, one "word<TAB>images holding it" line each
+        if (!index.isOpen() && !index.open(options.indexFile, folderStamp)) {
+            std::cerr << "The index " << options.indexFile << " can't be used for completion." << std::endl;
+            return 1;
+        }
+        std::string prefix = options.completePrefix;
+        std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::tolower);
+        auto completions = index.complete(prefix, options.topCount > 0 ? options.topCount : 10);
+        console << "\n" << completions.size() << " completions of " << options.completePrefix << "." << std::endl;
+        writeCompletions(completions, options);
+        return 0;
+    }
+
+    // Images moved by an earlier run live in 'Filtered_Search', they take part in the search again so they can stay or go back.
+    // Link runs already put them back in the folder before scanning it
+    std::string filteredFolder = folderPath + "\\Filtered_Search";
+    std::unordered_map<std::string, DWORD> existingImages;
+    if (!options.isListMode() && !options.isCountMode() && options.facets.empty()) {
+        existingImages = listFolderImages(filteredFolder);
+        if (options.outputMode == OutputMode::Move) {
+            std::unordered_set<std::string> filledFolders;
+            for (const auto& pair : existingImages) {
+                std::string subfolder = subfolderOfKey(pair.first);
+                if (filledFolders.insert(subfolder).second)
+                    fillDictionaryWithImageMetadata(subfolder.empty() ? filteredFolder : filteredFolder + "\\" + subfolder, store, pool,
+                                                    FileOrder::Directory, options.readMode);
+            }
+        }
+    }
+    console << "Finished processing all files." << std::endl;
+    if (store.compressed)
+        console << "Metadata compressed from " << std::accumulate(store.rawSizes.begin(), store.rawSizes.end(), (uint64_t)0) << " to "
+                << store.blocks.size() << " bytes, plus " << store.signatureWords.size() * 8 << " bytes of signatures." << std::endl;
+
+    if (!options.rulesFile.empty()) {
+        // All saved queries share one matcher, each image is scanned once whatever the number of rules
+        MultiPatternMatcher matcher(rulePatterns);
+        if (index.isOpen())
+            loadIndexImages(index, nullptr, std::vector<uint64_t>(), store, pool, [](const ImageStore&, size_t) { return true; });
+        std::vector<uint32_t> matches;
+        std::unordered_set<std::string> placements = routeImagesByRules(store, rules, matcher, pool, options.outputMode == OutputMode::Move, matches);
+        console << "\n" << rules.size() << " rules matched " << matches.size() << " images." << std::endl;
+
+        if (options.isListMode())
+            writeFilteredList(store, matches, folderPath, options);
+        else
+            moveFilteredImages(placements, folderPath, existingImages, pool, options.outputMode);
+        return 0;
+    }
+
+    // Search for metadata
+    std::vector<std::string> searchTerms;
+    if (!readSearchTerms(options, console, searchTerms)) return 1;
+
+    if (options.topCount > 0) {
+        // Ranked results come from the index, which has just been written if it wasn't up to date
+        if (!index.isOpen() && !index.open(options.indexFile, folderStamp)) {
+            std::cerr << "The index " << options.indexFile << " can't be used for ranking." << std::endl;
+            return 1;
+        }
+        ImageStore ranked;
+        std::vector<uint32_t> best = rankIndexMatches(index, searchTerms, options.topCount);
+        loadIndexImages(index, &best, std::vector<uint64_t>(), ranked, pool, [](const ImageStore&, size_t) { return true; });
+        std::vector<uint32_t> matches(ranked.size());
+        std::iota(matches.begin(), matches.end(), 0);
+        console << "Kept the " << matches.size() << " most relevant matches." << std::endl;
+
+        if (options.isListMode())
+            writeFilteredList(ranked, matches, folderPath, options);
+        else
+            moveFilteredImages(routeFilteredImages(ranked, matches, options.groupBy), folderPath, existingImages, pool, options.outputMode);
+        return 0;
+    }
+
+    if (options.isCountMode()) {
+        // Only a number comes out, the matches are neither kept nor loaded from the index
+        bool stopAtFirst = options.outputMode == OutputMode::Exists;
+        size_t count = index.isOpen() ? countIndexMatches(index, searchTerms, pool, stopAtFirst) : countMatches(store, searchTerms, pool, stopAtFirst);
+        writeResults(stopAtFirst ? (count > 0 ? "yes\n" : "no\n") : std::to_string(count) + "\n", options);
+        return 0;
+    }
+
+    // Get a filtered dictionary we can use to filter the folder and get the images that have the metadata we want
+    if (index.isOpen()) loadIndexMatches(index, searchTerms, store, pool, options.limit);
+
+    if (!options.facets.empty()) {
+        // Statistics only, nothing is moved or listed, and the matches are counted where they are found
+        size_t matchCount = 0;
+        std::vector<FacetCounts> counts = aggregateFacets(store, searchTerms, options.facets, pool, matchCount);
+        console << "Counted " << options.facets.size() << " facets over " << matchCount << " matches." << std::endl;
+        writeFacets(options.facets, counts, options);
+        return 0;
+    }
+
+    std::vector<uint32_t> matches = filterDictionary(store, searchTerms);
+    if (options.limit > 0 && matches.size() > options.limit) matches.resize(options.limit);
+
+    if (options.isListMode())
+        writeFilteredList(store, matches, folderPath, options);
+    else
+        moveFilteredImages(routeFilteredImages(store, matches, options.groupBy), folderPath, existingImages, pool, options.outputMode);
 
     return 0;
-}
\ No newline at end of file
+}